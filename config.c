@@ -18,6 +18,13 @@ struct nakd_config_default {
     { "LED1_path", "/sys/class/leds/gl-connect:green:lan/brightness" },
     { "LED2_path", "/sys/class/leds/gl-connect:red:wlan/brightness" },
     { "stage", "reset" },
+    { "wq_min_threads", "2" },
+    { "wq_max_threads", "8" },
+    { "background_wq_min_threads", "1" },
+    { "background_wq_max_threads", "4" },
+    { "wan_carrier_debounce_ms", "2000" },
+    { "lan_carrier_debounce_ms", "2000" },
+    { "connectivity_debounce_ms", "5000" },
     {}
 };
 
@@ -7,7 +7,6 @@
 #include <json-c/json.h>
 #include "connectivity.h"
 #include "event.h"
-#include "timer.h"
 #include "netintf.h"
 #include "wlan.h"
 #include "log.h"
@@ -21,9 +20,12 @@
 #define GW_ARPING_SCRIPT NAKD_SCRIPT("util/arping_gateway.sh")
 #define GW_IP_SCRIPT NAKD_SCRIPT("util/gateway_ip.sh")
 #define CONNECTIVITY_UPDATE_INTERVAL 10000 /* ms */
+/* backed off to, while there are no wireless networks to connect to */
+#define CONNECTIVITY_UPDATE_MAX_INTERVAL 60000 /* ms */
 
 static pthread_mutex_t _connectivity_mutex;
-static struct nakd_timer *_connectivity_update_timer;
+static int _update_interval = CONNECTIVITY_UPDATE_INTERVAL;
+static int _connectivity_shutdown;
 
 #define CONNECTIVITY_STRING_ENTRY(state) [state] = #state
 const char *nakd_connectivity_string[] = {
@@ -54,10 +56,23 @@ static char *_gateway_ip(void) {
     return ip;
 }
 
+static void _schedule_update(int delay_ms);
+
 static void _connectivity_update(void *priv) {
+    /* copies, owned by us */
+    json_object *jcurrent = NULL;
+    json_object *jnetwork = NULL;
+
     pthread_mutex_lock(&_connectivity_mutex);
+    int interval = CONNECTIVITY_UPDATE_INTERVAL;
+    int ethernet = _ethernet_wan_available();
+    if (ethernet == -1) {
+        /* not synced with netlink yet, don't guess */
+        nakd_log(L_DEBUG, "Carrier state unknown, skipping the update.");
+        goto unlock;
+    }
     /* prefer ethernet */
-    if (_ethernet_wan_available() != 0) {
+    if (ethernet) {
         if (!nakd_interface_disabled(NAKD_WLAN))
             nakd_disable_interface(NAKD_WLAN);
         goto unlock; 
@@ -65,7 +80,7 @@ static void _connectivity_update(void *priv) {
 
     nakd_wlan_scan();
     nakd_log(L_DEBUG, "%d wireless networks available.", nakd_wlan_netcount());
-    json_object *jcurrent = nakd_wlan_current();
+    jcurrent = nakd_wlan_current();
     const char *current_ssid = NULL;
     if (jcurrent != NULL)
         current_ssid = nakd_net_ssid(jcurrent);
@@ -99,11 +114,15 @@ static void _connectivity_update(void *priv) {
 
     nakd_log(L_INFO, "No Ethernet or wireless connection, looking for WLAN"
                                                             " candidate.");
-    json_object *jnetwork = nakd_wlan_candidate();
+    jnetwork = nakd_wlan_candidate();
     if (jnetwork == NULL) {
         nakd_log(L_INFO, "No available wireless networks");
         if (!wan_disabled)
             nakd_event_push(CONNECTIVITY_LOST);
+        /* scanning over and over won't change much */
+        interval = _update_interval * 2;
+        if (interval > CONNECTIVITY_UPDATE_MAX_INTERVAL)
+            interval = CONNECTIVITY_UPDATE_MAX_INTERVAL;
         goto unlock;
     } 
 
@@ -111,41 +130,47 @@ static void _connectivity_update(void *priv) {
     nakd_log(L_INFO, "Connecting to wireless network \"%s\"", ssid);
     if (!nakd_wlan_connect(jnetwork)) {
         nakd_log(L_INFO, "Wireless connection configured, ssid: \"%s\"", ssid);
-        nakd_event_push(CONNECTIVITY_OK);
+        nakd_event_push_data(&(struct event_data){
+            .event = CONNECTIVITY_OK,
+            .interface = NAKD_WLAN,
+            .ssid = ssid
+        });
     }
 
 unlock:
+    _update_interval = interval;
+    if (!_connectivity_shutdown)
+        _schedule_update(interval);
     pthread_mutex_unlock(&_connectivity_mutex);
+    json_object_put(jcurrent);
+    json_object_put(jnetwork);
 }
 
 static struct work_desc _update_desc = {
     .impl = _connectivity_update,
     .name = "connectivity update",
+    .coalesce = WORK_COALESCE
 };
 
-static void _connectivity_update_sighandler(siginfo_t *timer_info,
-                                       struct nakd_timer *timer) {
-    /* skip, if there's already a pending update in the workqueue */
-    if (!nakd_work_pending(nakd_wq, _update_desc.name)) {
-        struct work *work = nakd_alloc_work(&_update_desc);
-        nakd_workqueue_add(nakd_wq, work);
-    }
+/* Each update schedules the next one. */
+static void _schedule_update(int delay_ms) {
+    nakd_workqueue_submit_delayed(nakd_wq, &_update_desc, delay_ms);
 }
 
 static int _connectivity_init(void) {
     pthread_mutex_init(&_connectivity_mutex, NULL);
-    _connectivity_update_timer = nakd_timer_add(CONNECTIVITY_UPDATE_INTERVAL,
-                                      _connectivity_update_sighandler, NULL);
 
     nakd_event_push(CONNECTIVITY_LOST);
 
-    struct work *update = nakd_alloc_work(&_update_desc);
-    nakd_workqueue_add(nakd_wq, update);
+    nakd_workqueue_submit(nakd_wq, &_update_desc);
     return 0;
 }
 
 static int _connectivity_cleanup(void) {
-    nakd_timer_remove(_connectivity_update_timer);
+    pthread_mutex_lock(&_connectivity_mutex);
+    _connectivity_shutdown = 1;
+    nakd_workqueue_cancel_delayed(nakd_wq, _update_desc.name);
+    pthread_mutex_unlock(&_connectivity_mutex);
     pthread_mutex_destroy(&_connectivity_mutex);
     return 0;
 }
@@ -181,7 +206,7 @@ enum nakd_connectivity nakd_connectivity(void) {
 
 static struct nakd_module module_connectivity = {
     .name = "connectivity",
-    .deps = (const char *[]){ "workqueue", "event", "timer", "netintf", "wlan",
+    .deps = (const char *[]){ "workqueue", "event", "netintf", "wlan",
                                    "notification" /* event handlers */, NULL },
     .init = _connectivity_init,
     .cleanup = _connectivity_cleanup 
@@ -1,15 +1,96 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
 #include <pthread.h>
+#include <string.h>
+#include <json-c/json.h>
 #include "event.h"
 #include "thread.h"
 #include "log.h"
 #include "misc.h"
 #include "module.h"
 #include "workqueue.h"
+#include "jsonrpc.h"
+#include "command.h"
+#include "timer.h"
+#include "config.h"
+#include "server.h"
 
-#define MAX_EVENT_HANDLERS 64
+#define EVENT_HISTORY_SIZE 128
+/* longest events_since is let to wait */
+#define EVENTS_SINCE_MAX_WAIT 30000 /* ms */
 
-static pthread_mutex_t _event_mutex;
-static struct event_handler _event_handlers[MAX_EVENT_HANDLERS];
+/* Held for reading while handlers are called, for writing to change them. */
+static pthread_rwlock_t _event_lock;
+/* per event */
+static struct event_handler *_event_handlers[NAKD_EVENTS];
+
+/* The payload, with strings copied right after it. */
+struct event_copy {
+    struct event_data data;
+    char strings[];
+};
+
+struct event_record {
+    uint64_t seq;
+    time_t time;
+    struct event_copy *copy;
+};
+
+/*
+ * Ring of the last EVENT_HISTORY_SIZE events, event _history_seq is the
+ * latest one. Sequence numbers start with 1.
+ */
+static struct event_record _history[EVENT_HISTORY_SIZE];
+static uint64_t _history_seq;
+static pthread_mutex_t _history_mutex;
+
+/*
+ * Opposite events, eg. a carrier going up and down. The first transition
+ * goes through at once, the ones following within settle_ms of it are held
+ * back until things settle - then the last one is emitted, if it changes
+ * anything. Repeated events with the same payload are dropped.
+ */
+struct event_debounce {
+    const char *name;
+    const char *config_key;
+    enum nakd_event events[2];
+    int settle_ms;
+
+    pthread_mutex_t lock;
+    /* from an emit until _debounce_settled() finds nothing newer */
+    int settling;
+    struct nakd_timer *timer;
+    struct event_copy *emitted;
+    /* the latest event while settling */
+    struct event_copy *pending;
+    unsigned long pushed;
+    unsigned long emitted_count;
+};
+
+static struct event_debounce _debounces[] = {
+    {
+        .name = "wan_carrier",
+        .config_key = "wan_carrier_debounce_ms",
+        .events = { ETHERNET_WAN_PLUGGED, ETHERNET_WAN_LOST },
+        .settle_ms = 2000
+    },
+    {
+        .name = "lan_carrier",
+        .config_key = "lan_carrier_debounce_ms",
+        .events = { ETHERNET_LAN_PLUGGED, ETHERNET_LAN_LOST },
+        .settle_ms = 2000
+    },
+    {
+        .name = "connectivity",
+        .config_key = "connectivity_debounce_ms",
+        .events = { CONNECTIVITY_OK, CONNECTIVITY_LOST },
+        .settle_ms = 5000
+    },
+    {}
+};
+static struct event_debounce *_debounced[NAKD_EVENTS];
 
 #define EVENT_NAME_ENTRY(event) [event] = #event 
 const char *nakd_event_name[] = {
@@ -26,78 +107,494 @@ const char *nakd_event_name[] = {
     EVENT_NAME_ENTRY(CONNECTIVITY_LOST),
     EVENT_NAME_ENTRY(CONNECTIVITY_OK),
 
-    EVENT_NAME_ENTRY(NETWORK_TRAFFIC)
-};
+    EVENT_NAME_ENTRY(NETWORK_TRAFFIC),
 
-static struct event_handler *__get_event_handler_slot(void) {
-    struct event_handler *handler = _event_handlers;
+    EVENT_NAME_ENTRY(STAGE_CHANGED),
 
-    for (; handler < ARRAY_END(_event_handlers) && handler->active; handler++);
-    if (handler >= ARRAY_END(_event_handlers))
-        return NULL;
-    return handler;
+    EVENT_NAME_ENTRY(WLAN_SCAN_DONE),
+    NULL
+};
+
+enum nakd_event nakd_event_byname(const char *name) {
+    for (const char **event_name = nakd_event_name + EVENT_UNSPECIFIED + 1;
+                                       *event_name != NULL; event_name++) {
+        if (!strcmp(*event_name, name))
+            return ARRAY_ELEMENT_NUMBER(event_name, nakd_event_name);
+    }
+    return EVENT_UNSPECIFIED;
 }
 
 struct event_handler *nakd_event_add_handler(enum nakd_event event,
                               nakd_event_handler hnd, void *priv) {
-    pthread_mutex_lock(&_event_mutex);
-    struct event_handler *handler = __get_event_handler_slot();
-    if (handler == NULL)
-        nakd_terminate("Out of event handler slots.");
+    nakd_assert(event > EVENT_UNSPECIFIED && event < NAKD_EVENTS);
 
+    struct event_handler *handler = calloc(1, sizeof(struct event_handler));
+    nakd_assert(handler != NULL);
     handler->event = event;
     handler->impl = hnd;
     handler->priv = priv;
-    handler->active = 1;
-    pthread_mutex_unlock(&_event_mutex);
+
+    /* called in the order they were added */
+    pthread_rwlock_wrlock(&_event_lock);
+    struct event_handler **tail = &_event_handlers[event];
+    for (; *tail != NULL; tail = &(*tail)->next);
+    *tail = handler;
+    pthread_rwlock_unlock(&_event_lock);
 
     nakd_log(L_DEBUG, "Added event handler for %s.", nakd_event_name[event]);
     return handler;
 }
 
+/*
+ * Waits for dispatches in progress, the handler isn't called anymore once it
+ * returns. Not to be called from a handler.
+ */
 void nakd_event_remove_handler(struct event_handler *handler) {
-    pthread_mutex_lock(&_event_mutex);
-    handler->active = 0;
-    pthread_mutex_unlock(&_event_mutex);
+    pthread_rwlock_wrlock(&_event_lock);
+    struct event_handler **iter = &_event_handlers[handler->event];
+    for (; *iter != NULL && *iter != handler; iter = &(*iter)->next);
+    if (*iter != NULL)
+        *iter = handler->next;
+    pthread_rwlock_unlock(&_event_lock);
+
+    free(handler);
+}
+
+static size_t _string_size(const char *str) {
+    return str != NULL ? strlen(str) + 1 : 0;
+}
+
+static const char *_copy_string(char **dst, const char *str) {
+    if (str == NULL)
+        return NULL;
+
+    const char *copy = *dst;
+    size_t size = strlen(str) + 1;
+    memcpy(*dst, str, size);
+    *dst += size;
+    return copy;
 }
 
-static void _call_handler(void *priv) {
-    struct event_handler *handler = priv;
-    handler->impl(handler->event, handler->priv);
+static struct event_copy *_event_copy(const struct event_data *data) {
+    struct event_copy *copy = malloc(sizeof(struct event_copy)
+               + _string_size(data->ssid) + _string_size(data->previous)
+                                          + _string_size(data->current));
+    nakd_assert(copy != NULL);
+    copy->data = *data;
+    char *strings = copy->strings;
+    copy->data.ssid = _copy_string(&strings, data->ssid);
+    copy->data.previous = _copy_string(&strings, data->previous);
+    copy->data.current = _copy_string(&strings, data->current);
+    return copy;
+}
+
+static void _history_record(const struct event_data *data) {
+    pthread_mutex_lock(&_history_mutex);
+    struct event_record *record = &_history[++_history_seq %
+                                          EVENT_HISTORY_SIZE];
+    free(record->copy);
+    record->seq = _history_seq;
+    record->time = time(NULL);
+    record->copy = _event_copy(data);
+    pthread_mutex_unlock(&_history_mutex);
+}
+
+/* Calls every handler of the event, in a single workqueue entry. */
+static void _dispatch(void *priv) {
+    struct event_copy *copy = priv;
+    enum nakd_event event = copy->data.event;
+
+    pthread_rwlock_rdlock(&_event_lock);
+    for (struct event_handler *handler = _event_handlers[event];
+                         handler != NULL; handler = handler->next) {
+        handler->impl(&copy->data, handler->priv);
+    }
+    pthread_rwlock_unlock(&_event_lock);
+    free(copy);
+}
+
+static void _emit(const struct event_data *data) {
+    enum nakd_event event = data->event;
+
+    _history_record(data);
+
+    pthread_rwlock_rdlock(&_event_lock);
+    int handled = _event_handlers[event] != NULL;
+    pthread_rwlock_unlock(&_event_lock);
+    if (!handled)
+        return;
+
+    nakd_log(L_INFO, "Handling event %s.", nakd_event_name[event]);
+
+    struct work_desc _event_desc = {
+        .impl = _dispatch,
+        .name = nakd_event_name[event],
+        .priv = _event_copy(data)
+    };
+    nakd_workqueue_submit(nakd_wq, &_event_desc);
+}
+
+static int _string_eq(const char *a, const char *b) {
+    if (a == NULL || b == NULL)
+        return a == b;
+    return !strcmp(a, b);
+}
+
+static int _same_event(const struct event_data *a,
+                       const struct event_data *b) {
+    return a->event == b->event && a->interface == b->interface &&
+                                       _string_eq(a->ssid, b->ssid) &&
+                               _string_eq(a->previous, b->previous) &&
+                                _string_eq(a->current, b->current);
+}
+
+static void __debounce_emit(struct event_debounce *debounce,
+                                   struct event_copy *copy) {
+    free(debounce->emitted);
+    debounce->emitted = copy;
+    debounce->emitted_count++;
+    _emit(&copy->data);
+    /* hold back whatever follows for a while */
+    debounce->settling = 1;
+    nakd_timer_mod(debounce->timer, debounce->settle_ms);
+}
+
+static void _debounce(struct event_debounce *debounce,
+                          const struct event_data *data) {
+    pthread_mutex_lock(&debounce->lock);
+    debounce->pushed++;
+
+    /*
+     * Not the timer - it's already disarmed while _debounce_settled() waits
+     * for the lock.
+     */
+    if (debounce->settling) {
+        free(debounce->pending);
+        debounce->pending = _event_copy(data);
+        /* still flapping, start over */
+        nakd_timer_mod(debounce->timer, debounce->settle_ms);
+        goto unlock;
+    }
+
+    /* whatever's left from settling is older than this one */
+    free(debounce->pending), debounce->pending = NULL;
+    if (debounce->emitted != NULL && _same_event(&debounce->emitted->data,
+                                                                  data)) {
+        goto unlock;
+    }
+    __debounce_emit(debounce, _event_copy(data));
+
+unlock:
+    pthread_mutex_unlock(&debounce->lock);
+}
+
+static void _debounce_settled(struct nakd_timer *timer) {
+    struct event_debounce *debounce = timer->priv;
+
+    pthread_mutex_lock(&debounce->lock);
+    /* rearmed while we were waiting for the lock */
+    if (nakd_timer_armed(timer))
+        goto unlock;
+
+    debounce->settling = 0;
+    struct event_copy *pending = debounce->pending;
+    debounce->pending = NULL;
+    if (pending == NULL)
+        goto unlock;
+
+    if (debounce->emitted != NULL && _same_event(&debounce->emitted->data,
+                                                          &pending->data)) {
+        nakd_log(L_INFO, "%s settled, nothing changed.", debounce->name);
+        free(pending);
+        goto unlock;
+    }
+    nakd_log(L_INFO, "%s settled: %s", debounce->name,
+                  nakd_event_name[pending->data.event]);
+    __debounce_emit(debounce, pending);
+
+unlock:
+    pthread_mutex_unlock(&debounce->lock);
+}
+
+void nakd_event_push_data(const struct event_data *data) {
+    enum nakd_event event = data->event;
+    nakd_assert(event > EVENT_UNSPECIFIED && event < NAKD_EVENTS);
+
+    if (_debounced[event] != NULL)
+        _debounce(_debounced[event], data);
+    else
+        _emit(data);
 }
 
 void nakd_event_push(enum nakd_event event) {
-    pthread_mutex_lock(&_event_mutex);
-    for (struct event_handler *handler = _event_handlers;
-         handler < ARRAY_END(_event_handlers); handler++) {
-        if (handler->active && handler->event == event) {
-            nakd_log(L_INFO, "Handling event %s.", nakd_event_name[event]);
-
-            struct work_desc _event_desc = {
-                .impl = _call_handler,
-                .name = nakd_event_name[handler->event],
-                .priv = handler
-            };
-            struct work *work = nakd_alloc_work(&_event_desc);
-            nakd_workqueue_add(nakd_wq, work);
+    nakd_event_push_data(&(struct event_data){ .event = event });
+}
+
+/* The event's name and whatever payload it has. */
+json_object *nakd_event_json(const struct event_data *data) {
+    json_object *jevent = json_object_new_object();
+    json_object_object_add(jevent, "event",
+         json_object_new_string(nakd_event_name[data->event]));
+    if (data->interface != INTF_UNSPECIFIED) {
+        json_object_object_add(jevent, "interface",
+             json_object_new_string(nakd_interface_type[data->interface]));
+    }
+    if (data->ssid != NULL)
+        json_object_object_add(jevent, "ssid",
+                   json_object_new_string(data->ssid));
+    if (data->previous != NULL)
+        json_object_object_add(jevent, "previous",
+               json_object_new_string(data->previous));
+    if (data->current != NULL)
+        json_object_object_add(jevent, "current",
+                json_object_new_string(data->current));
+    return jevent;
+}
+
+static int _config_settle_ms(struct event_debounce *debounce) {
+    char *val = NULL;
+    if (nakd_config_key(debounce->config_key, &val))
+        return debounce->settle_ms;
+
+    char *end;
+    long settle_ms = strtol(val, &end, 10);
+    if (*val == 0 || *end != 0 || settle_ms < 0) {
+        nakd_log(L_WARNING, "Invalid %s: \"%s\", using %d.",
+             debounce->config_key, val, debounce->settle_ms);
+        settle_ms = debounce->settle_ms;
+    }
+    free(val);
+    return settle_ms;
+}
+
+static void _debounce_init(void) {
+    for (struct event_debounce *debounce = _debounces; debounce->name;
+                                                        debounce++) {
+        debounce->settle_ms = _config_settle_ms(debounce);
+        /* 0 turns it off */
+        if (!debounce->settle_ms)
+            continue;
+
+        pthread_mutex_init(&debounce->lock, NULL);
+        debounce->timer = nakd_timer_add_oneshot(-1, _debounce_settled,
+                                                             debounce);
+        nakd_assert(debounce->timer != NULL);
+        for (enum nakd_event *event = debounce->events;
+                    event < ARRAY_END(debounce->events); event++) {
+            _debounced[*event] = debounce;
         }
     }
-    pthread_mutex_unlock(&_event_mutex);
 }
-    
+
+static void _debounce_cleanup(void) {
+    for (struct event_debounce *debounce = _debounces; debounce->name;
+                                                        debounce++) {
+        if (debounce->timer == NULL)
+            continue;
+
+        for (enum nakd_event *event = debounce->events;
+                    event < ARRAY_END(debounce->events); event++) {
+            _debounced[*event] = NULL;
+        }
+        nakd_timer_remove(debounce->timer), debounce->timer = NULL;
+        free(debounce->emitted), debounce->emitted = NULL;
+        free(debounce->pending), debounce->pending = NULL;
+        pthread_mutex_destroy(&debounce->lock);
+    }
+}
+
 static int _event_init(void) {
-    pthread_mutex_init(&_event_mutex, NULL);
+    pthread_rwlock_init(&_event_lock, NULL);
+
+    pthread_mutex_init(&_history_mutex, NULL);
+
+    _debounce_init();
+    return 0;
 }
 
 static int _event_cleanup(void) {
-    pthread_mutex_destroy(&_event_mutex);
+    _debounce_cleanup();
+
+    pthread_rwlock_wrlock(&_event_lock);
+    for (struct event_handler **list = _event_handlers;
+                 list < ARRAY_END(_event_handlers); list++) {
+        while (*list != NULL) {
+            struct event_handler *next = (*list)->next;
+            free(*list);
+            *list = next;
+        }
+    }
+    pthread_rwlock_unlock(&_event_lock);
+    pthread_rwlock_destroy(&_event_lock);
+
+    for (struct event_record *record = _history;
+          record < ARRAY_END(_history); record++) {
+        free(record->copy), record->copy = NULL;
+    }
+    pthread_mutex_destroy(&_history_mutex);
+    return 0;
 }
 
 static struct nakd_module module_event = {
     .name = "event",
-    .deps = (const char *[]){ "thread", "workqueue", NULL },
+    .deps = (const char *[]){ "thread", "workqueue", "timer", "config",
+                                                                 NULL },
     .init = _event_init,
     .cleanup = _event_cleanup
 };
 
 NAKD_DECLARE_MODULE(module_event);
+
+static int _get_uint_param(json_object *jparams, const char *key,
+                                                  uint64_t *value) {
+    json_object *jvalue = NULL;
+    json_object_object_get_ex(jparams, key, &jvalue);
+    if (jvalue == NULL)
+        return 0;
+    if (json_object_get_type(jvalue) != json_type_int)
+        return 1;
+    int64_t signed_value = json_object_get_int64(jvalue);
+    if (signed_value < 0)
+        return 1;
+    *value = signed_value;
+    return 0;
+}
+
+/* called with _history_mutex held */
+static json_object *__events_since(json_object *jcmd, uint64_t cursor) {
+    uint64_t oldest = _history_seq > EVENT_HISTORY_SIZE ?
+                      _history_seq - EVENT_HISTORY_SIZE + 1 : 1;
+    uint64_t first = cursor + 1;
+    int missed = 0;
+    if (first < oldest)
+        missed = oldest - first, first = oldest;
+
+    json_object *jevents = json_object_new_array();
+    for (uint64_t seq = first; seq <= _history_seq; seq++) {
+        struct event_record *record = &_history[seq % EVENT_HISTORY_SIZE];
+        json_object *jevent = nakd_event_json(&record->copy->data);
+        json_object_object_add(jevent, "seq",
+                     json_object_new_int64(record->seq));
+        json_object_object_add(jevent, "time",
+                    json_object_new_int64(record->time));
+        json_object_array_add(jevents, jevent);
+    }
+
+    json_object *jresult = json_object_new_object();
+    json_object_object_add(jresult, "cursor",
+               json_object_new_int64(_history_seq));
+    json_object_object_add(jresult, "missed", json_object_new_int(missed));
+    json_object_object_add(jresult, "events", jevents);
+    return nakd_jsonrpc_response_success(jcmd, jresult);
+}
+
+/* Polled by the server thread while the request is parked on a connection. */
+static json_object *_poll_events_since(json_object *jcmd, int expired,
+                                                          void *priv) {
+    const uint64_t *cursor = priv;
+    json_object *jresponse = NULL;
+
+    pthread_mutex_lock(&_history_mutex);
+    if (expired || _history_seq > *cursor)
+        jresponse = __events_since(jcmd, *cursor);
+    pthread_mutex_unlock(&_history_mutex);
+    return jresponse;
+}
+
+json_object *cmd_events_since(json_object *jcmd, void *arg) {
+    uint64_t cursor = 0;
+    uint64_t timeout = 0;
+
+    json_object *jparams = nakd_jsonrpc_params(jcmd);
+    if (jparams != NULL && (json_object_get_type(jparams) !=
+                                               json_type_object ||
+                   _get_uint_param(jparams, "cursor", &cursor) ||
+                 _get_uint_param(jparams, "timeout", &timeout))) {
+        return nakd_jsonrpc_response_error(jcmd, INVALID_PARAMS,
+             "Invalid parameters - params should be an object with "
+             "optional non-negative integer \"cursor\" and \"timeout\" "
+                                                          "members");
+    }
+    if (timeout > EVENTS_SINCE_MAX_WAIT)
+        timeout = EVENTS_SINCE_MAX_WAIT;
+
+    pthread_mutex_lock(&_history_mutex);
+    /* from before a restart */
+    if (cursor > _history_seq)
+        cursor = 0;
+    int wait = timeout && _history_seq <= cursor;
+    pthread_mutex_unlock(&_history_mutex);
+
+    /* the server thread answers once there's something past cursor */
+    if (wait) {
+        uint64_t *deferred_cursor = malloc(sizeof(uint64_t));
+        nakd_assert(deferred_cursor != NULL);
+        *deferred_cursor = cursor;
+        if (!nakd_server_defer(jcmd, timeout, _poll_events_since,
+                                                 deferred_cursor)) {
+            return NULL;
+        }
+        free(deferred_cursor);
+    }
+
+    pthread_mutex_lock(&_history_mutex);
+    json_object *jresponse = __events_since(jcmd, cursor);
+    pthread_mutex_unlock(&_history_mutex);
+    return jresponse;
+}
+
+static struct nakd_command events_since = {
+    .name = "events_since",
+    .desc = "Events after \"cursor\", out of the last "
+       "128 ones. Waits up to \"timeout\" ms (at most 30s) for one if there "
+           "are none yet, except in batches. Pass the returned \"cursor\" to "
+                 "the next call; \"missed\" counts events that were dropped "
+                                                "from history meanwhile.",
+    .usage = "{\"jsonrpc\": \"2.0\", \"method\": \"events_since\", \"params\":"
+                           " {\"cursor\": 42, \"timeout\": 10000}, \"id\": 42}",
+    .handler = cmd_events_since,
+    .access = ACCESS_USER,
+    .module = &module_event
+};
+NAKD_DECLARE_COMMAND(events_since);
+
+json_object *cmd_event_debounce(json_object *jcmd, void *arg) {
+    json_object *jresult = json_object_new_object();
+    for (struct event_debounce *debounce = _debounces; debounce->name;
+                                                        debounce++) {
+        json_object *jdebounce = json_object_new_object();
+        json_object_object_add(jdebounce, "settle_ms",
+                  json_object_new_int(debounce->settle_ms));
+        if (debounce->timer != NULL) {
+            pthread_mutex_lock(&debounce->lock);
+            json_object_object_add(jdebounce, "pushed",
+                     json_object_new_int64(debounce->pushed));
+            json_object_object_add(jdebounce, "suppressed",
+                json_object_new_int64(debounce->pushed -
+                                 debounce->emitted_count));
+            if (debounce->emitted != NULL) {
+                enum nakd_event last = debounce->emitted->data.event;
+                json_object_object_add(jdebounce, "last",
+                  json_object_new_string(nakd_event_name[last]));
+            }
+            json_object_object_add(jdebounce, "settling",
+                   json_object_new_boolean(debounce->settling));
+            pthread_mutex_unlock(&debounce->lock);
+        }
+        json_object_object_add(jresult, debounce->name, jdebounce);
+    }
+    return nakd_jsonrpc_response_success(jcmd, jresult);
+}
+
+static struct nakd_command event_debounce = {
+    .name = "event_debounce",
+    .desc = "Debounced events: how long they're let to settle, how many were "
+               "pushed and how many of these were suppressed, the last one "
+                                          "emitted and whether it's settling.",
+    .usage = "{\"jsonrpc\": \"2.0\", \"method\": \"event_debounce\", "
+                                                           "\"id\": 42}",
+    .handler = cmd_event_debounce,
+    .access = ACCESS_USER,
+    .module = &module_event
+};
+NAKD_DECLARE_COMMAND(event_debounce);
@@ -0,0 +1,421 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
+#include "helper.h"
+#include "shell.h"
+#include "log.h"
+
+/*
+ * The helper is forked off at startup, before any module creates a thread,
+ * and spawns commands on nakd's behalf - so that nakd's own address space,
+ * however large it gets, is never copied and spawning latency doesn't depend
+ * on it.
+ *
+ * Requests are single SOCK_SEQPACKET messages sent over _helper_fd, along
+ * with a per-job socket and, optionally, the command's stdout. The helper
+ * runs any number of jobs at once, replies with the exit status on the job
+ * socket once the command exits and kills the command if nakd hangs up the
+ * job socket, or once its timeout expires.
+ */
+#define HELPER_MAX_REQUEST 32768
+#define HELPER_NAME "nakd-helper"
+
+struct helper_request {
+    int timeout; /* ms, 0 - none */
+    int argc;
+    int output;
+    /* followed by cwd, empty if none, and argv - null-terminated */
+};
+
+struct helper_reply {
+    int spawned;
+    int timed_out;
+    int wstatus;
+};
+
+struct helper_job {
+    pid_t pid;
+    int fd; /* -1 once nakd hung up */
+    uint64_t deadline; /* ms, 0 - none */
+    int timed_out;
+};
+
+/* helper process */
+static struct helper_job *_jobs;
+static int _jobs_count;
+static int _jobs_size;
+
+/* nakd */
+static int _helper_fd = -1;
+static pid_t _helper_pid = -1;
+static int _helper_gone;
+
+static uint64_t _ticks(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec) * 1000 + now.tv_nsec / (int)(1e6);
+}
+
+static void _reply(int fd, struct helper_reply *reply) {
+    if (send(fd, reply, sizeof *reply, MSG_NOSIGNAL) == -1)
+        nakd_log(L_DEBUG, "Couldn't reply: %s", strerror(errno));
+}
+
+static void _job_add(pid_t pid, int fd, int timeout) {
+    if (_jobs_count == _jobs_size) {
+        _jobs_size = _jobs_size ? _jobs_size * 2 : 8;
+        _jobs = realloc(_jobs, _jobs_size * sizeof(struct helper_job));
+        nakd_assert(_jobs != NULL);
+    }
+
+    _jobs[_jobs_count++] = (struct helper_job){
+        .pid = pid,
+        .fd = fd,
+        .deadline = timeout > 0 ? _ticks() + timeout : 0
+    };
+}
+
+static void _job_kill(struct helper_job *job) {
+    if (kill(job->pid, SIGKILL) == -1)
+        nakd_log(L_WARNING, "kill(): %s", strerror(errno));
+}
+
+static void _receive_request(int sock) {
+    char buf[HELPER_MAX_REQUEST];
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof buf };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof control.buf
+    };
+
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (!n) {
+        /* nakd is gone, or shutting down */
+        _exit(0);
+    }
+    if (n == -1) {
+        if (errno == EINTR)
+            return;
+        nakd_terminate("recvmsg(): %s", strerror(errno));
+    }
+
+    int fds[2] = { -1, -1 };
+    int nfds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+                                  cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (nfds > 2)
+            nfds = 2;
+        memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    }
+
+    const char **argv = NULL;
+    struct helper_request *req = (struct helper_request *)(buf);
+    if ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+         (size_t)(n) <= sizeof(struct helper_request) || buf[n - 1] ||
+                 req->argc < 1 || nfds != 1 + !!req->output) {
+        nakd_log(L_WARNING, "Malformed request, ignoring.");
+        goto close;
+    }
+
+    argv = calloc(req->argc + 1, sizeof(char *));
+    nakd_assert(argv != NULL);
+
+    const char *p = buf + sizeof(struct helper_request);
+    const char *cwd = p;
+    p += strlen(p) + 1;
+    for (int i = 0; i < req->argc; i++) {
+        if (p >= buf + n) {
+            nakd_log(L_WARNING, "Malformed request, ignoring.");
+            goto close;
+        }
+        argv[i] = p;
+        p += strlen(p) + 1;
+    }
+
+    pid_t pid = nakd_shell_spawn(argv, *cwd ? cwd : NULL, fds[1]);
+    if (pid == -1) {
+        _reply(fds[0], &(struct helper_reply){ .spawned = 0 });
+        goto close;
+    }
+    _job_add(pid, fds[0], req->timeout);
+    fds[0] = -1;
+
+close:
+    free(argv);
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] != -1)
+            close(fds[i]);
+    }
+}
+
+static void _reap_jobs(void) {
+    pid_t pid;
+    int wstatus;
+    while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+        for (int i = 0; i < _jobs_count; i++) {
+            struct helper_job *job = &_jobs[i];
+            if (job->pid != pid)
+                continue;
+
+            if (job->fd != -1) {
+                _reply(job->fd, &(struct helper_reply){
+                    .spawned = 1,
+                    .timed_out = job->timed_out,
+                    .wstatus = wstatus
+                });
+                close(job->fd);
+            }
+            _jobs[i] = _jobs[--_jobs_count];
+            break;
+        }
+    }
+}
+
+/* Kills jobs nakd isn't interested in anymore, or past their deadline. */
+static void _check_jobs(struct pollfd *fds) {
+    uint64_t now = _ticks();
+    for (int i = 0; i < _jobs_count; i++) {
+        struct helper_job *job = &_jobs[i];
+        if (job->fd != -1 && fds[i].revents) {
+            _job_kill(job);
+            close(job->fd), job->fd = -1;
+        } else if (job->deadline && now >= job->deadline && !job->timed_out) {
+            nakd_log(L_NOTICE, "pid %d timed out, killing.", job->pid);
+            _job_kill(job);
+            job->timed_out = 1;
+        }
+    }
+}
+
+static int _poll_timeout(void) {
+    uint64_t next = 0;
+    for (int i = 0; i < _jobs_count; i++) {
+        struct helper_job *job = &_jobs[i];
+        if (!job->deadline || job->timed_out)
+            continue;
+        if (!next || job->deadline < next)
+            next = job->deadline;
+    }
+    if (!next)
+        return -1;
+
+    uint64_t now = _ticks();
+    return next > now ? next - now : 0;
+}
+
+static void _helper_loop(int sock) {
+    /* nakd's signals are none of our business, we go once it hangs up */
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    prctl(PR_SET_NAME, HELPER_NAME);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sfd == -1)
+        nakd_terminate("signalfd(): %s", strerror(errno));
+
+    struct pollfd *fds = NULL;
+    int fds_size = 0;
+    for (;;) {
+        if (fds_size < _jobs_count + 2) {
+            fds_size = _jobs_size + 2;
+            fds = realloc(fds, fds_size * sizeof(struct pollfd));
+            nakd_assert(fds != NULL);
+        }
+
+        /* a job socket is only ever polled for a hangup */
+        fds[0] = (struct pollfd){ .fd = sock, .events = POLLIN };
+        fds[1] = (struct pollfd){ .fd = sfd, .events = POLLIN };
+        for (int i = 0; i < _jobs_count; i++)
+            fds[2 + i] = (struct pollfd){ .fd = _jobs[i].fd };
+
+        if (poll(fds, _jobs_count + 2, _poll_timeout()) == -1) {
+            if (errno == EINTR)
+                continue;
+            nakd_terminate("poll(): %s", strerror(errno));
+        }
+
+        _check_jobs(fds + 2);
+
+        if (fds[1].revents) {
+            struct signalfd_siginfo si;
+            while (read(sfd, &si, sizeof si) > 0);
+            _reap_jobs();
+        }
+
+        if (fds[0].revents & POLLIN)
+            _receive_request(sock);
+        else if (fds[0].revents)
+            _exit(0);
+    }
+}
+
+/*
+ * Called before any threads are created, nakd runs without the helper if it
+ * can't be started.
+ */
+int nakd_helper_start(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        nakd_log(L_WARNING, "socketpair(): %s", strerror(errno));
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        nakd_log(L_WARNING, "fork(): %s", strerror(errno));
+        close(sv[0]), close(sv[1]);
+        return -1;
+    }
+
+    if (!pid) {
+        close(sv[0]);
+        _helper_loop(sv[1]);
+    }
+
+    close(sv[1]);
+    _helper_fd = sv[0];
+    _helper_pid = pid;
+    nakd_log(L_INFO, "Started " HELPER_NAME ", pid %d.", pid);
+    return 0;
+}
+
+void nakd_helper_stop(void) {
+    if (_helper_fd == -1)
+        return;
+
+    close(_helper_fd), _helper_fd = -1;
+    while (waitpid(_helper_pid, NULL, 0) == -1 && errno == EINTR);
+    _helper_pid = -1;
+}
+
+static size_t _append(char *buf, size_t len, const char *str) {
+    size_t size = strlen(str) + 1;
+    if (len + size > HELPER_MAX_REQUEST)
+        return HELPER_MAX_REQUEST + 1;
+    memcpy(buf + len, str, size);
+    return len + size;
+}
+
+/*
+ * Returns a socket to wait for the result on with nakd_helper_result(),
+ * closing it kills the command. -1 if there's no helper to run it - it's
+ * up to the caller to spawn the command itself then.
+ */
+int nakd_helper_spawn(const char **argv, const char *cwd, int out_fd,
+                                                       int timeout_ms) {
+    if (_helper_fd == -1 || _helper_gone)
+        return -1;
+
+    char *buf = malloc(HELPER_MAX_REQUEST);
+    nakd_assert(buf != NULL);
+
+    struct helper_request *req = (struct helper_request *)(buf);
+    *req = (struct helper_request){
+        .timeout = timeout_ms,
+        .output = out_fd != -1
+    };
+    size_t len = sizeof(struct helper_request);
+    len = _append(buf, len, cwd != NULL ? cwd : "");
+    for (; argv[req->argc] != NULL; req->argc++)
+        len = _append(buf, len, argv[req->argc]);
+
+    int sv[2] = { -1, -1 };
+    if (len > HELPER_MAX_REQUEST) {
+        nakd_log(L_NOTICE, "Command line too long for " HELPER_NAME ".");
+        goto fail;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        nakd_log(L_WARNING, "socketpair(): %s", strerror(errno));
+        goto fail;
+    }
+
+    int fds[2] = { sv[1], out_fd };
+    int nfds = out_fd != -1 ? 2 : 1;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof control);
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(nfds * sizeof(int))
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+    /* a single message, workers don't have to take turns */
+    ssize_t n;
+    while ((n = sendmsg(_helper_fd, &msg, MSG_NOSIGNAL)) == -1 &&
+                                                     errno == EINTR);
+    if (n == -1) {
+        nakd_log(L_CRIT, HELPER_NAME " is gone (sendmsg(): %s), spawning "
+                                "commands directly.", strerror(errno));
+        _helper_gone = 1;
+        goto fail;
+    }
+
+    close(sv[1]);
+    free(buf);
+    return sv[0];
+
+fail:
+    if (sv[0] != -1)
+        close(sv[0]), close(sv[1]);
+    free(buf);
+    return -1;
+}
+
+/*
+ * To be called once job_fd is readable. Returns 0 and the command's wait
+ * status, -1 if it couldn't be run.
+ */
+int nakd_helper_result(int job_fd, int *wstatus) {
+    struct helper_reply reply;
+    ssize_t n;
+    while ((n = recv(job_fd, &reply, sizeof reply, 0)) == -1 &&
+                                                   errno == EINTR);
+    if (n != sizeof reply) {
+        nakd_log(L_CRIT, HELPER_NAME " didn't reply.");
+        return -1;
+    }
+    if (!reply.spawned)
+        return -1;
+
+    if (reply.timed_out)
+        nakd_log(L_NOTICE, "Command timed out, killed by " HELPER_NAME ".");
+    *wstatus = reply.wstatus;
+    return 0;
+}
@@ -1,5 +1,7 @@
 #ifndef NAKD_EVENT_H
 #define NAKD_EVENT_H
+#include <json-c/json.h>
+#include "netintf.h"
 
 enum nakd_event {
     EVENT_UNSPECIFIED,
@@ -16,25 +18,49 @@ enum nakd_event {
     CONNECTIVITY_LOST,
     CONNECTIVITY_OK,
 
-    NETWORK_TRAFFIC
+    NETWORK_TRAFFIC,
+
+    STAGE_CHANGED,
+
+    WLAN_SCAN_DONE,
+
+    NAKD_EVENTS
 };
 
 extern const char *nakd_event_name[];
 
-typedef void (*nakd_event_handler)(enum nakd_event event, void *priv);
+/* Event payload, members that don't apply are left 0 or NULL. */
+struct event_data {
+    enum nakd_event event;
+    enum nakd_interface interface;
+    const char *ssid;
+    /* eg. stage names */
+    const char *previous;
+    const char *current;
+};
+
+/* data is only valid during the call. */
+typedef void (*nakd_event_handler)(const struct event_data *data,
+                                                       void *priv);
 
 struct event_handler {
     enum nakd_event event;
     nakd_event_handler impl;
     void *priv;
 
-    int active;
+    struct event_handler *next;
 };
 
 void nakd_event_push(enum nakd_event event);
+void nakd_event_push_data(const struct event_data *data);
+json_object *nakd_event_json(const struct event_data *data);
+enum nakd_event nakd_event_byname(const char *name);
 
 struct event_handler *nakd_event_add_handler(enum nakd_event event,
                                nakd_event_handler hnd, void *priv);
 void nakd_event_remove_handler(struct event_handler *handler);
 
+json_object *cmd_events_since(json_object *jcmd, void *arg);
+json_object *cmd_event_debounce(json_object *jcmd, void *arg);
+
 #endif
@@ -0,0 +1,11 @@
+#ifndef NAKD_HELPER_H
+#define NAKD_HELPER_H
+
+int nakd_helper_start(void);
+void nakd_helper_stop(void);
+
+int nakd_helper_spawn(const char **argv, const char *cwd, int out_fd,
+                                                       int timeout_ms);
+int nakd_helper_result(int job_fd, int *wstatus);
+
+#endif
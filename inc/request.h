@@ -6,4 +6,8 @@ json_object *nakd_handle_message(json_object *jmsg);
 json_object *nakd_handle_single(json_object *jmsg);
 json_object *nakd_handle_batch(json_object *jmsg);
 
+/* id of the connection the current request came from, 0 if none */
+void nakd_request_set_client(int client);
+int nakd_request_client(void);
+
 #endif
@@ -1,8 +1,27 @@
 #ifndef NAKD_SERVER_H
 #define NAKD_SERVER_H
+#include <json-c/json.h>
 
 void nakd_accept_loop(void);
 int nakd_active_connections(void);
 void nakd_shutdown_connections(void);
 
+/*
+ * Called by the server thread with the request once there might be a response
+ * and when timeout_ms passes, ie. expired is set. Returns the response, or NULL
+ * to keep waiting - once expired, the request is done either way.
+ */
+typedef json_object *(*nakd_deferred_poll)(json_object *jcmd, int expired,
+                                                              void *priv);
+/*
+ * Lets a command handler leave the request waiting without holding a worker;
+ * it's then polled after every event. The handler returns NULL afterwards,
+ * and priv is released with free() once the request is done. Returns 1 if
+ * the request can't be deferred, eg. it's a batch entry or a notification.
+ */
+int nakd_server_defer(json_object *jcmd, int timeout_ms,
+                     nakd_deferred_poll poll, void *priv);
+
+json_object *cmd_subscribe(json_object *jcmd, void *arg);
+
 #endif
@@ -1,15 +1,21 @@
 #ifndef NAKD_SHELL_H
 #define NAKD_SHELL_H
+#include <sys/types.h>
 #include <json-c/json.h>
 #include "command.h"
 
 #define MAX_SHELL_RESULT_LEN 262144
+/* commands still running after that long are killed */
+#define NAKD_SHELL_TIMEOUT 600000 /* ms */
+/* per script, run with nakd_shell_run_scripts() */
+#define NAKD_SCRIPT_TIMEOUT 60000 /* ms */
 
 #define NAKD_SCRIPT_PATH "/usr/share/nakd/scripts/"
 #define NAKD_SCRIPT(filename) NAKD_SCRIPT_PATH filename
 
 int nakd_shell_exec(const char *cwd, char **output, const char *fmt, ...);
 int nakd_shell_exec_argv(const char **argv, const char *cwd, char **output);
+pid_t nakd_shell_spawn(const char **argv, const char *cwd, int out_fd);
 
 typedef int (*nakd_traverse_cb)(const char *path, void *priv);
 int nakd_traverse_directory(const char *path, nakd_traverse_cb cb, void *priv);
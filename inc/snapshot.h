@@ -0,0 +1,38 @@
+#ifndef NAKD_SNAPSHOT_H
+#define NAKD_SNAPSHOT_H
+#include <pthread.h>
+#include <json-c/json.h>
+
+/*
+ * Immutable, refcounted module state. Never modified once created - readers
+ * take a reference instead of copying. json-c isn't thread-safe, so don't
+ * json_object_get()/put() or serialize jstate nodes, use json instead.
+ */
+struct nakd_snapshot {
+    int refcount;
+    json_object *jstate;
+    int len;
+    char json[];
+};
+
+/*
+ * Latest published snapshot, swapped under its own lock. Writers publish
+ * with the module lock held, so code holding it may use current directly.
+ */
+struct nakd_snapshot_slot {
+    pthread_mutex_t lock;
+    struct nakd_snapshot *current;
+};
+
+struct nakd_snapshot *nakd_snapshot_create(json_object *jstate);
+void nakd_snapshot_get(struct nakd_snapshot *snapshot);
+void nakd_snapshot_put(struct nakd_snapshot *snapshot);
+json_object *nakd_snapshot_json(struct nakd_snapshot *snapshot);
+
+void nakd_snapshot_slot_init(struct nakd_snapshot_slot *slot);
+void nakd_snapshot_slot_cleanup(struct nakd_snapshot_slot *slot);
+void nakd_snapshot_publish(struct nakd_snapshot_slot *slot,
+                            struct nakd_snapshot *snapshot);
+struct nakd_snapshot *nakd_snapshot_acquire(struct nakd_snapshot_slot *slot);
+
+#endif
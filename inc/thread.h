@@ -15,6 +15,7 @@ struct nakd_thread {
     void *priv;
 
     int active;
+    int abandoned;
 };
 
 int nakd_thread_create_detached(nakd_thread_routine start,
@@ -25,6 +26,7 @@ int nakd_thread_create_joinable(nakd_thread_routine start,
                              struct nakd_thread **thread);
 int nakd_thread_kill(struct nakd_thread *thr);
 void nakd_thread_killall(void);
+void nakd_thread_abandon(struct nakd_thread *thr);
 struct nakd_thread *nakd_thread_private(void);
 
 #endif
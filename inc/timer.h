@@ -1,21 +1,30 @@
 #ifndef NAKD_TIMER_H
 #define NAKD_TIMER_H
-#include <signal.h>
+#include <stdint.h>
 
 struct nakd_timer;
-typedef void (*nakd_timer_handler)(siginfo_t *timer_info,
-                               struct nakd_timer *timer);
+typedef void (*nakd_timer_handler)(struct nakd_timer *timer);
 struct nakd_timer {
-    timer_t id;
     nakd_timer_handler handler;
     void *priv;
 
+    int interval; /* ms, 0 if one-shot */
+    uint64_t expires; /* ms, CLOCK_MONOTONIC */
     int active;
+
+    /* private to timer.c */
+    int expired;
+    int removed;
+    struct nakd_timer *next;
+    struct nakd_timer **pprev;
 };
 
 struct nakd_timer *nakd_timer_add(int interval_ms, nakd_timer_handler handler,
                                                                   void *priv);
-void __nakd_timer_remove(struct nakd_timer *timer);
+struct nakd_timer *nakd_timer_add_oneshot(int delay_ms,
+              nakd_timer_handler handler, void *priv);
+void nakd_timer_mod(struct nakd_timer *timer, int delay_ms);
+int nakd_timer_armed(struct nakd_timer *timer);
 void nakd_timer_remove(struct nakd_timer *timer);
 
 #endif
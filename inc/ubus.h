@@ -1,5 +1,6 @@
 #ifndef NAKD_UBUS_H
 #define NAKD_UBUS_H
+#include <json-c/json.h>
 
 /* -std=c99 */
 #define typeof __typeof
@@ -9,5 +10,6 @@
 
 int nakd_ubus_call(const char *namespace, const char* procedure,
        const char *arg, ubus_data_handler_t cb, void *cb_priv);
+json_object *nakd_blobmsg_to_json(struct blob_attr *msg);
 
 #endif
@@ -5,6 +5,8 @@
 json_object *nakd_wlan_candidate(void);
 int nakd_wlan_netcount(void);
 int nakd_wlan_scan(void);
+int nakd_wlan_scan_start(void);
+int nakd_wlan_scan_wait(int id);
 int nakd_wlan_connect(json_object *jnetwork);
 int nakd_wlan_disconnect(void);
 json_object *nakd_wlan_current(void);
@@ -21,6 +23,7 @@ const char *nakd_ap_interface_name(void);
 json_object *cmd_wlan_list_stored(json_object *jcmd, void *arg);
 json_object *cmd_wlan_list(json_object *jcmd, void *arg);
 json_object *cmd_wlan_scan(json_object *jcmd, void *arg);
+json_object *cmd_wlan_scan_wait(json_object *jcmd, void *arg);
 json_object *cmd_wlan_connect(json_object *jcmd, void *arg);
 json_object *cmd_configure_ap(json_object *jcmd, void *arg);
 
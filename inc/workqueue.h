@@ -1,63 +1,173 @@
 #ifndef NAKD_WORKQUEUE_H
 #define NAKD_WORKQUEUE_H
 #include <pthread.h>
+#include <stdint.h>
 #include <time.h>
-#include <setjmp.h>
 #include "thread.h"
 
-#define NAKD_DEFAULT_WQ_THREADS 8
+/* defaults, see wq_min_threads etc. in nakd configuration */
+#define NAKD_DEFAULT_WQ_MIN_THREADS 2
+#define NAKD_DEFAULT_WQ_MAX_THREADS 8
+#define NAKD_BACKGROUND_WQ_MIN_THREADS 1
+#define NAKD_BACKGROUND_WQ_MAX_THREADS 4
+/* per workqueue */
+#define NAKD_WQ_MAX_THREADS 32
 
 typedef void (*nakd_work_func)(void *priv);
 
 enum work_status {
+    WORK_SCHEDULED,
     WORK_QUEUED,
     WORK_PROCESSING,
     WORK_DONE,
     WORK_CANCELED
 };
 
+/* Queued entries of a higher class are dequeued first. */
+enum work_priority {
+    /* the default - event handlers, notifications, state updates */
+    WORK_PRIORITY_EVENT,
+    /* somebody's waiting for the result */
+    WORK_PRIORITY_INTERACTIVE,
+    /* long-running, eg. scans and stage scripts */
+    WORK_PRIORITY_BACKGROUND,
+
+    WORK_PRIORITIES
+};
+
+/* Entries are coalesced by name. */
+enum work_coalesce {
+    WORK_NO_COALESCE,
+    /* dropped if an entry with the same name is queued or being processed */
+    WORK_COALESCE,
+    /*
+     * dropped if an entry with the same name is queued, but queued if it's
+     * only being processed - so that it runs once more after it finishes
+     */
+    WORK_COALESCE_RERUN
+};
+
 struct work_desc {
     nakd_work_func impl;
-    /* Called when entry has timed out or was canceled. */
+    /*
+     * Called if the entry didn't return after it had been canceled and its
+     * worker was abandoned. impl() may still be running, or return while
+     * canceled() runs, so it mustn't free anything impl() uses - the entry
+     * itself is kept till canceled() returns.
+     */
     nakd_work_func canceled;
     void *priv;   
     const char *name;
     /*
      * Effect:
      * Allocated struct work won't be freed and nakd_workqueue_add will return
-     * only after either impl() returns or canceled() is called due to timeout.
+     * only after impl() returns.
      */
     int synchronous;
     int timeout; /* seconds */
+    /* ignored for synchronous entries */
+    enum work_coalesce coalesce;
+    enum work_priority priority;
+};
+
+/* Work timing out is warned about, canceled, and then abandoned. */
+enum work_timeout_stage {
+    WORK_TIMEOUT_WARN,
+    WORK_TIMEOUT_CANCEL,
+    WORK_TIMEOUT_ABANDON
 };
 
 struct work {
     struct work_desc desc;
 
     time_t start_time;
-    sigjmp_buf canceled_jmpbuf;
+    uint64_t start_ms; /* CLOCK_MONOTONIC */
+    uint64_t queued_us; /* CLOCK_MONOTONIC */
+    /* cancellation token, see nakd_work_canceled() */
+    int canceled;
     pthread_cond_t completed_cv;
     enum work_status status;
+    /*
+     * ms, CLOCK_MONOTONIC - when it's to be queued, if scheduled, or the
+     * next timeout check, if being processed
+     */
+    uint64_t deadline;
+    int heap_idx;
+    enum work_timeout_stage timeout_stage;
+    /* the worker, while being processed */
+    struct nakd_thread *thread;
 
     struct work *next;
 };
 
+#define NAKD_WQ_PENDING_BUCKETS 32
+
+/* Number of queued and processed entries with a given name. */
+struct work_pending {
+    char *name;
+    int count;
+    int queued;
+    /* WORK_COALESCE_RERUN entry, queued once none is being processed */
+    struct work *rerun;
+
+    struct work_pending *next;
+};
+
+/* min-heap of entries, by deadline */
+struct work_heap {
+    struct work **works;
+    int count;
+    int size;
+};
+
 struct workqueue {
     pthread_mutex_t lock; 
-    struct work *work;
+    /* a FIFO per priority class */
+    struct work *work[WORK_PRIORITIES];
+    struct work **tail[WORK_PRIORITIES];
+    int depth[WORK_PRIORITIES];
+    struct work_pending *pending[NAKD_WQ_PENDING_BUCKETS];
+    /* delayed entries */
+    struct work_heap scheduled;
+    /* entries being processed with a timeout, guarded by _status_lock */
+    struct work_heap timeouts;
+    /* classes handled by a dedicated pool, set with nakd_workqueue_bind() */
+    struct workqueue *pools[WORK_PRIORITIES];
+    /* recycled entries */
+    struct work *free;
+    int free_count;
 
+    /* max_threads slots, the first threadcount taken */
     struct nakd_thread **threads;
     int threadcount;
+    int min_threads;
+    int max_threads;
+    /* workers waiting for entries */
+    int idle;
     pthread_cond_t cv;
     int shutdown;
+
+    /* every workqueue, checked for timeouts */
+    struct workqueue *next;
 };
 
-void nakd_workqueue_create(struct workqueue **wq, int threads);
+void nakd_workqueue_create(struct workqueue **wq, int min_threads,
+                                                  int max_threads);
 void nakd_workqueue_destroy(struct workqueue **wq);
+void nakd_workqueue_bind(struct workqueue *wq, enum work_priority priority,
+                                                    struct workqueue *pool);
 struct work *nakd_alloc_work(const struct work_desc *desc);
 void nakd_free_work(struct work *work);
-void nakd_workqueue_add(struct workqueue *wq, struct work *work);
+unsigned long nakd_work_allocs(void);
+int nakd_workqueue_add(struct workqueue *wq, struct work *work);
+int nakd_workqueue_submit(struct workqueue *wq, const struct work_desc *desc);
+void nakd_workqueue_submit_delayed(struct workqueue *wq,
+               const struct work_desc *desc, int delay_ms);
+void nakd_workqueue_add_delayed(struct workqueue *wq, struct work *work,
+                                                            int delay_ms);
+int nakd_workqueue_cancel_delayed(struct workqueue *wq, const char *name);
 int nakd_work_pending(struct workqueue *wq, const char *name);
+int nakd_work_canceled(void);
 
 extern struct workqueue *nakd_wq;
 
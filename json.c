@@ -3,18 +3,38 @@
 #include "json.h"
 #include "log.h"
 
-/* json-c isn't thread-safe, and AFAIK it's the only way of making a deep
- * copy. Let's come back to it later.
- */
-json_object *nakd_json_deepcopy(json_object *object) {
-    const char *object_str = json_object_get_string(object);
-    json_tokener *jtok = json_tokener_new();
-    json_object *jresult = json_tokener_parse_ex(jtok, object_str,
-                                              strlen(object_str));
-    nakd_assert(json_tokener_get_error(jtok) == json_tokener_success);
-    nakd_assert(jresult != NULL);
-    json_tokener_free(jtok);
-    return jresult;
+/* Structural copy, jobject is only read - no serialization involved. */
+json_object *nakd_json_deepcopy(json_object *jobject) {
+    if (jobject == NULL)
+        return NULL;
+
+    switch (json_object_get_type(jobject)) {
+    case json_type_boolean:
+        return json_object_new_boolean(json_object_get_boolean(jobject));
+    case json_type_double:
+        return json_object_new_double(json_object_get_double(jobject));
+    case json_type_int:
+        return json_object_new_int64(json_object_get_int64(jobject));
+    case json_type_string:
+        return json_object_new_string_len(json_object_get_string(jobject),
+                                      json_object_get_string_len(jobject));
+    case json_type_array: {
+        json_object *jresult = json_object_new_array();
+        for (int i = 0; i < json_object_array_length(jobject); i++) {
+            json_object_array_add(jresult, nakd_json_deepcopy(
+                           json_object_array_get_idx(jobject, i)));
+        }
+        return jresult;
+    }
+    case json_type_object: {
+        json_object *jresult = json_object_new_object();
+        json_object_object_foreach(jobject, key, jval)
+            json_object_object_add(jresult, key, nakd_json_deepcopy(jval));
+        return jresult;
+    }
+    default:
+        return NULL;
+    }
 }
 
 const char *nakd_json_get_string(json_object *jobject, const char *key) {
@@ -133,8 +133,10 @@ json_object *nakd_jsonrpc_response_success(json_object *request,
 
     /* nakd_jsonrpc_response will return a valid pointer even if the request
        doesn't have an id to handle PARSE_ERROR and INVALID_REQUEST. */
-    if (!nakd_jsonrpc_has_id(request))
+    if (!nakd_jsonrpc_has_id(request)) {
+        json_object_put(result);
         return NULL;
+    }
 
     json_object *jresp = nakd_jsonrpc_response(request);
     if (jresp == NULL)
@@ -1,10 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/time.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <errno.h>
 #include <pthread.h>
-#include <signal.h>
 #include "led.h"
 #include "log.h"
 #include "misc.h"
@@ -13,15 +14,31 @@
 #include "module.h"
 
 #define MAX_CONDITIONS 16
-#define UPDATE_INTERVAL 33 /* ms */
+#define MAX_LEDS 8
+
+/*
+ * Brightness files are kept open and only written to when the value changes.
+ * Infinite blinking is left to the kernel "timer" trigger, if the LED has one,
+ * anything else is timed with _blink_timer, armed for the next transition.
+ */
+struct led {
+    char *path; /* brightness */
+    int fd;
+    int value; /* last written, -1 if unknown */
+    int blink_interval; /* ms, 0 unless blinking with the "timer" trigger */
+};
 
 static pthread_mutex_t _led_mutex;
 static struct led_condition _led_conditions[MAX_CONDITIONS];
 static struct led_state *_last_states = NULL;
 static struct led_condition *_current_condition = NULL;
-static struct nakd_timer *_led_timer;
-
-static timer_t _blink_timer;
+static struct led _leds[MAX_LEDS];
+static struct nakd_timer *_blink_timer;
+/*
+ * Set while _blink_timer is armed for __blink_step(). A callback that was
+ * already waiting for _led_mutex when the condition changed finds it unset.
+ */
+static int _blink_scheduled;
 
 static struct led_condition *__get_condition_slot(void) {
     struct led_condition *cond = _led_conditions;
@@ -43,6 +60,8 @@ static int _led_condition_active(const char *name) {
     return 0;
 }
 
+static void __led_update(void);
+
 void nakd_led_condition_add(struct led_condition *cond) {
     pthread_mutex_lock(&_led_mutex);
     if (_led_condition_active(cond->name))
@@ -55,6 +74,7 @@ void nakd_led_condition_add(struct led_condition *cond) {
     }
     *_cond = *cond;
     _cond->active = 1;
+    __led_update();
 
 unlock:
     pthread_mutex_unlock(&_led_mutex);
@@ -74,6 +94,7 @@ void nakd_led_condition_remove(const char *name) {
         if (!strcmp(name, cond->name))
             _led_condition_remove(cond);
     }
+    __led_update();
     pthread_mutex_unlock(&_led_mutex);
 }
 
@@ -91,30 +112,113 @@ static struct led_condition *__choose_condition(void) {
     return cond;
 }
 
-static void __set_state(struct led_state *state, int active) {
+static struct led *__get_led(struct led_state *state) {
     if (!state->_led_fs_path) {
         if (nakd_config_key(state->led_config_key, &state->_led_fs_path)) {
             nakd_log(L_WARNING, "Couldn't retrieve LED path from nakd "
                                                      "configuration.");
-            return;
+            return NULL;
         }
     }
 
-    if (access(state->_led_fs_path, W_OK)) {
-        nakd_log(L_WARNING, "Couldn't access LED chardev at %s",
-                                           state->_led_fs_path);
+    struct led *free_led = NULL;
+    for (struct led *led = _leds; led < ARRAY_END(_leds); led++) {
+        if (led->path == NULL) {
+            if (free_led == NULL)
+                free_led = led;
+        } else if (!strcmp(led->path, state->_led_fs_path)) {
+            return led;
+        }
+    }
+    if (free_led == NULL) {
+        nakd_log(L_CRIT, "Out of LED slots.");
+        return NULL;
+    }
+
+    int fd = open(state->_led_fs_path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        nakd_log(L_WARNING, "Couldn't open chardev at %s for writing (%s)",
+                                  state->_led_fs_path, strerror(errno));
+        return NULL;
+    }
+
+    free_led->path = state->_led_fs_path;
+    free_led->fd = fd;
+    free_led->value = -1;
+    free_led->blink_interval = 0;
+    return free_led;
+}
+
+/* Writes a sysfs attribute next to the LED's brightness file. */
+static int _led_attr_write(struct led *led, const char *attr,
+                                            const char *value) {
+    const char *dir_end = strrchr(led->path, '/');
+    if (dir_end == NULL)
+        return -1;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%.*s/%s", (int)(dir_end - led->path),
+                                                       led->path, attr);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    int status = 0;
+    if (write(fd, value, strlen(value)) == -1)
+        status = -1;
+    close(fd);
+    return status;
+}
+
+static void __led_blink_stop(struct led *led) {
+    if (!led->blink_interval)
         return;
+
+    _led_attr_write(led, "trigger", "none");
+    led->blink_interval = 0;
+    /* the kernel turns it off, don't rely on that though */
+    led->value = -1;
+}
+
+static int __led_blink_start(struct led *led, int interval) {
+    if (led->blink_interval == interval)
+        return 0;
+
+    char delay[16];
+    snprintf(delay, sizeof delay, "%d", interval);
+    /* delay_on and delay_off show up once the trigger is set */
+    if (_led_attr_write(led, "trigger", "timer") ||
+        _led_attr_write(led, "delay_on", delay) ||
+        _led_attr_write(led, "delay_off", delay)) {
+        _led_attr_write(led, "trigger", "none");
+        led->value = -1;
+        return -1;
     }
 
-    FILE *led_fp = fopen(state->_led_fs_path, "w");
-    if (led_fp == NULL) {
-        nakd_log(L_WARNING, "Couldn't open chardev at %s for writing",
-                                                 state->_led_fs_path);
+    led->blink_interval = interval;
+    led->value = -1;
+    return 0;
+}
+
+static void __led_set(struct led *led, int value) {
+    __led_blink_stop(led);
+    if (led->value == value)
+        return;
+
+    if (pwrite(led->fd, value ? "1\n" : "0\n", 2, 0) == -1) {
+        nakd_log(L_WARNING, "Couldn't write to chardev at %s (%s)",
+                                        led->path, strerror(errno));
+        led->value = -1;
         return;
     }
+    led->value = value;
+}
 
-    fputs(state->active && active ? "1\n" : "0\n", led_fp);
-    fclose(led_fp);
+static void __set_state(struct led_state *state, int active) {
+    struct led *led = __get_led(state);
+    if (led != NULL)
+        __led_set(led, state->active && active);
 }
 
 static void __set_states(struct led_state *states, int active) {
@@ -123,54 +227,115 @@ static void __set_states(struct led_state *states, int active) {
         __set_state(states, active);
 }
 
-static void __update_condition(void) {
-    if (_current_condition == NULL)
+static void __blink_stop_all(void) {
+    for (struct led *led = _leds; led < ARRAY_END(_leds); led++) {
+        if (led->path != NULL)
+            __led_blink_stop(led);
+    }
+}
+
+/* Returns 0 if the kernel blinks all of the states, from now on. */
+static int __blink_states_offload(struct led_state *states, int interval) {
+    for (struct led_state *state = states; state->led_config_key; state++) {
+        struct led *led = __get_led(state);
+        if (led == NULL)
+            goto fail;
+
+        if (!state->active)
+            __led_set(led, 0);
+        else if (__led_blink_start(led, interval))
+            goto fail;
+    }
+    _last_states = states;
+    return 0;
+
+fail:
+    nakd_log(L_DEBUG, "Can't offload LED blinking to the kernel, falling "
+                                                    "back to a timer.");
+    __blink_stop_all();
+    return -1;
+}
+
+/* One blink transition, arms _blink_timer for the next. */
+static void __blink_step(void) {
+    if (!_current_condition->blink.count) {
+        _led_condition_remove(_current_condition);
+        __led_update();
         return;
+    }
 
-    if (_current_condition->blink.on) {
-        if (!_current_condition->blink.count) {
-            _led_condition_remove(_current_condition);
-            return;
-        }
+    __set_states(_current_condition->states == NULL ?
+           _last_states : _current_condition->states,
+                    _current_condition->blink.state);
+    _current_condition->blink.state = !_current_condition->blink.state;
+    if (_current_condition->blink.count > 0)
+       _current_condition->blink.count--;
 
-        struct itimerspec timer_state;
-        timer_gettime(_blink_timer, &timer_state);
-        if (!timer_state.it_value.tv_nsec) {
-            __set_states(_current_condition->states == NULL ?
-                   _last_states : _current_condition->states,
-                            _current_condition->blink.state);
-            _current_condition->blink.state = !_current_condition->blink.state;
-            if (_current_condition->blink.count > 0)
-               _current_condition->blink.count--;
-
-            timer_state.it_value.tv_sec =
-                _current_condition->blink.interval * (int)(1e6) / (int)(1e9);
-            timer_state.it_value.tv_nsec =
-                (_current_condition->blink.interval * (int)(1e6)) % (int)(1e9);
-            timer_settime(_blink_timer, 0, &timer_state, NULL);
-        }
-    } else {
-        __set_states(_current_condition->states, 1);
+    nakd_timer_mod(_blink_timer, _current_condition->blink.interval);
+    _blink_scheduled = 1;
+}
+
+static void __apply_condition(void) {
+    nakd_timer_mod(_blink_timer, -1);
+    _blink_scheduled = 0;
+
+    struct led_condition *cond = _current_condition;
+    if (cond == NULL) {
+        __blink_stop_all();
+        return;
     }
+
+    if (!cond->blink.on) {
+        __set_states(cond->states, 1);
+        return;
+    }
+
+    struct led_state *states = cond->states == NULL ? _last_states :
+                                                          cond->states;
+    /* periodic, let the kernel do it */
+    if (cond->blink.count < 0 && states != NULL &&
+          !__blink_states_offload(states, cond->blink.interval)) {
+        return;
+    }
+    __blink_step();
 }
 
 static void __swap_condition(struct led_condition *next) {
-    nakd_log(L_DEBUG, "Next LED condition: %s", next->name);
+    if (next != NULL)
+        nakd_log(L_DEBUG, "Next LED condition: %s", next->name);
     _current_condition = next;
+    __apply_condition();
 }
 
-static void _led_sighandler(siginfo_t *timer_info, struct nakd_timer *timer) {
-    pthread_mutex_lock(&_led_mutex);
+/* Called whenever the set of conditions changes. */
+static void __led_update(void) {
     struct led_condition *next = __choose_condition();
     if (next != NULL) {
         if (_current_condition == NULL || !_current_condition->active ||
                         next->priority > _current_condition->priority) {
             __swap_condition(next);
         }
+    } else if (_current_condition != NULL && !_current_condition->active) {
+        __swap_condition(NULL);
     }
+}
 
-    if (_current_condition->active)
-        __update_condition();
+static void _blink_timer_cb(struct nakd_timer *timer) {
+    pthread_mutex_lock(&_led_mutex);
+    /* rearmed while we were waiting for the lock, not due yet */
+    if (nakd_timer_armed(timer))
+        goto unlock;
+
+    /* stale, eg. the kernel blinks the LEDs by now */
+    if (!_blink_scheduled)
+        goto unlock;
+    _blink_scheduled = 0;
+
+    if (_current_condition == NULL || !_current_condition->blink.on)
+        goto unlock;
+    __blink_step();
+
+unlock:
     pthread_mutex_unlock(&_led_mutex);
 }
 
@@ -189,22 +354,28 @@ static struct led_condition _default = {
 
 static int _led_init(void) {
     pthread_mutex_init(&_led_mutex, NULL);
-    _led_timer = nakd_timer_add(UPDATE_INTERVAL, _led_sighandler, NULL);
-    nakd_assert(_led_timer != NULL);
-
-    struct sigevent sev = {
-        .sigev_notify = SIGEV_NONE
-    };
-    if (timer_create(CLOCK_REALTIME, &sev, &_blink_timer) == -1)
-        nakd_terminate("Couldn't create a timer. (%s)", strerror(errno));
+    _blink_timer = nakd_timer_add_oneshot(-1, _blink_timer_cb, NULL);
+    nakd_assert(_blink_timer != NULL);
 
     nakd_led_condition_add(&_default);
+    return 0;
 }
 
 static int _led_cleanup(void) {
-    timer_delete(_blink_timer);
-    nakd_timer_remove(_led_timer);
+    nakd_timer_remove(_blink_timer);
+
+    pthread_mutex_lock(&_led_mutex);
+    for (struct led *led = _leds; led < ARRAY_END(_leds); led++) {
+        if (led->path == NULL)
+            continue;
+
+        __led_blink_stop(led);
+        close(led->fd);
+        led->path = NULL;
+    }
+    pthread_mutex_unlock(&_led_mutex);
     pthread_mutex_destroy(&_led_mutex);
+    return 0;
 }
 
 static struct nakd_module module_led = {
@@ -11,6 +11,7 @@
 #include "log.h"
 #include "nak_signal.h"
 #include "module.h"
+#include "helper.h"
 
 #define PID_PATH "/run/nakd/nakd.pid"
 
@@ -69,9 +70,13 @@ int main(int argc, char *argv[]) {
 
     /* TODO: CHECK IF CURRENT USER IS ROOT AND IF NAKD USER EXISTS */
 
+    /* while there's just the one thread and little memory to copy */
+    nakd_helper_start();
+
     nakd_init_modules();
     nakd_sigwait_loop();
     nakd_cleanup_modules();
+    nakd_helper_stop();
 
     nakd_log_close();
     return 0;
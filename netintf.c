@@ -1,23 +1,44 @@
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <json-c/json.h>
 #include "netintf.h"
 #include "jsonrpc.h"
 #include "json.h"
 #include "ubus.h"
 #include "log.h"
-#include "timer.h"
+#include "thread.h"
 #include "event.h"
 #include "nak_uci.h"
 #include "module.h"
 #include "workqueue.h"
 #include "command.h"
+#include "snapshot.h"
 
 #define NETINTF_UBUS_SERVICE "network.device"
 #define NETINTF_UBUS_METHOD "status"
 
-#define NETINTF_UPDATE_INTERVAL 1000 /* ms */
+/* interface_state refreshes older state on demand */
+#define NETINTF_STATE_MAX_AGE 1 /* s */
+
+/* while network.device isn't there yet, eg. at boot */
+#define NETINTF_RETRY_INTERVAL 1000 /* ms */
+#define NETINTF_RETRY_MAX_INTERVAL 60000 /* ms */
+
+#define NETLINK_BUFSIZE 8192
+/* for the initial link dump, done by the netlink thread if it takes longer */
+#define NETLINK_SYNC_TIMEOUT 1 /* s */
+
+#ifndef IFF_LOWER_UP
+#define IFF_LOWER_UP 0x10000 /* linux/if.h, clashes with net/if.h */
+#endif
 
 /* eg. "option nak_lan_tag 1" for wired lan interface */
 const char *nakd_uci_interface_tag[] = {
@@ -36,15 +57,25 @@ const char *nakd_interface_type[] = {
     [NAKD_AP] = "AP"
 };
 
-static json_object *_previous_netintf_state = NULL;
-static json_object *_current_netintf_state = NULL;
-static struct nakd_timer *_netintf_update_timer;
+/* interface state keyed by nakd_interface_type, eg. "WAN" */
+static struct nakd_snapshot_slot _netintf_state;
+/* CLOCK_MONOTONIC, guarded by _netintf_mutex */
+static time_t _netintf_state_updated;
+
+/* RTNLGRP_LINK listener, carrier changes come from here */
 static struct nakd_thread *_netintf_thread;
+static int _netlink_fd = -1;
+static int _netlink_shutdown;
+/* the initial link dump is done, guarded by _netintf_mutex */
+static int _link_state_synced;
 
-static pthread_cond_t _netintf_cv;
 static pthread_mutex_t _netintf_mutex;
 
 static int _netintf_updates_disabled;
+/* ms, 0 unless the last update failed */
+static int _update_retry;
+/* a single delayed retry at a time, on-demand updates wait for it */
+static int _retry_pending;
 
 struct carrier_event {
     /* eg. ETHERNET_WAN_PLUGGED */
@@ -57,6 +88,8 @@ struct interface {
     enum nakd_interface id;
     /* eg. eth1, filled by netintf code */
     char *name;
+    /* IFF_LOWER_UP as reported by netlink, -1 until known */
+    int carrier_state;
 
     struct carrier_event *carrier;
 } static _interfaces[] = {
@@ -190,35 +223,25 @@ static int _read_intf_config(struct uci_option *option, void *priv) {
 
 static void _read_config(void) {
     /* update interface->name with tags found in UCI */
-    for (struct interface *intf = _interfaces; intf->id; intf++)
+    for (struct interface *intf = _interfaces; intf->id; intf++) {
+        intf->carrier_state = -1;
         nakd_update_iface_config(intf->id, _read_intf_config, intf);
+    }
 }
 
-static int __carrier_present(const char *intf) {
-    json_object *jnode = NULL;
-    json_object_object_get_ex(_current_netintf_state, intf, &jnode);
-
-    if (jnode == NULL)
-        return -1;
-
-    json_object *jcarrier = NULL;
-    json_object_object_get_ex(jnode, "carrier", &jcarrier);
-
-    if (jcarrier == NULL)
-        return -1;
-
-    nakd_assert(json_object_get_type(jcarrier) == json_type_boolean);
-    return json_object_get_boolean(jcarrier);
-}
-
-static char *__interface_name(enum nakd_interface id) {
+static struct interface *__interface(enum nakd_interface id) {
     for (struct interface *intf = _interfaces; intf->id; intf++) {
         if (intf->id == id)
-            return intf->name;
+            return intf;
     }
     return NULL;
 }
 
+static char *__interface_name(enum nakd_interface id) {
+    struct interface *intf = __interface(id);
+    return intf == NULL ? NULL : intf->name;
+}
+
 char *nakd_interface_name(enum nakd_interface id) {
     pthread_mutex_lock(&_netintf_mutex);
     char *name = __interface_name(id);
@@ -227,120 +250,76 @@ char *nakd_interface_name(enum nakd_interface id) {
 }
 
 int nakd_carrier_present(enum nakd_interface id) {
-    int status = 1;
+    int status;
 
     pthread_mutex_lock(&_netintf_mutex);
-    char *intf_name = __interface_name(id);
-    if (intf_name == NULL) {
+    struct interface *intf = __interface(id);
+    if (intf == NULL || intf->name == NULL) {
         nakd_log(L_CRIT, "There's no interface with id %s",
                                   nakd_interface_type[id]);
         status = -1;
         goto unlock;
     }
 
-    status = __carrier_present(intf_name);
+    status = intf->carrier_state;
 
 unlock:
     pthread_mutex_unlock(&_netintf_mutex);
     return status;
 }
 
+/* Whether carrier state is known, it comes from netlink - not ubus. */
 int nakd_iface_state_available(void) {
     pthread_mutex_lock(&_netintf_mutex);
-    int s = _current_netintf_state != NULL;
+    int s = _link_state_synced;
     pthread_mutex_unlock(&_netintf_mutex);
     return s;
 }
 
-static void __push_carrier_events(void) {
-    if (_previous_netintf_state == NULL ||
-           _current_netintf_state == NULL)
-        return;
-
+/* Picks tagged interfaces out of network.device status, takes jstatus. */
+static json_object *_interface_state(json_object *jstatus) {
+    json_object *jresult = json_object_new_object();
     for (struct interface *intf = _interfaces; intf->id; intf++) {
-        if (intf->name == NULL || intf->carrier == NULL) 
-            continue;
-
-        json_object *jnode_previous = NULL;
-        json_object_object_get_ex(_previous_netintf_state, intf->name,
-                                                     &jnode_previous);
-        if (jnode_previous == NULL)
-            continue;
-
-        json_object *jnode_current = NULL;
-        json_object_object_get_ex(_current_netintf_state, intf->name,
-                                                     &jnode_current);
-        if (jnode_current == NULL) {
-            nakd_log(L_CRIT, "An interface is missing from current "
-                    NETINTF_UBUS_SERVICE " " NETINTF_UBUS_METHOD " "
-                                                          "state.");
-            continue;
+        json_object *jstate = NULL;
+        if (intf->name != NULL)
+            json_object_object_get_ex(jstatus, intf->name, &jstate);
+        if (jstate == NULL) {
+            nakd_log(L_DEBUG, "There's no %s interface in current interface "
+                       "status, continuing.", nakd_interface_type[intf->id]);
         }
 
-        json_object *jcarrier_previous = NULL;
-        json_object_object_get_ex(jnode_previous, "carrier",
-                                        &jcarrier_previous);
-        if (jcarrier_previous == NULL)
-            continue;
-        nakd_assert(json_object_get_type(jcarrier_previous) ==
-                                           json_type_boolean);
-
-        json_object *jcarrier_current = NULL;
-        json_object_object_get_ex(jnode_current, "carrier",
-                                        &jcarrier_current);
-        nakd_assert(jcarrier_current != NULL);
-        nakd_assert(json_object_get_type(jcarrier_current) ==
-                                          json_type_boolean);
-
-        int carrier_previous = json_object_get_boolean(jcarrier_previous); 
-        int carrier_current = json_object_get_boolean(jcarrier_current);
-
-        enum nakd_event event_id = EVENT_UNSPECIFIED;
-        if (carrier_previous && !carrier_current)
-            event_id = intf->carrier->event_no_carrier;
-        else if (!carrier_previous && carrier_current)
-            event_id = intf->carrier->event_carrier_present;
-
-        if (event_id != EVENT_UNSPECIFIED) {
-            nakd_log(L_DEBUG, "Generating event: %s",
-                          nakd_event_name[event_id]);
-            nakd_event_push(event_id);
-        }
+        json_object_object_add(jresult, nakd_interface_type[intf->id],
+                                               json_object_get(jstate));
     }
-}
-
-static void __netintf_diff(void) {
-    __push_carrier_events();
+    json_object_put(jstatus);
+    return jresult;
 }
 
 static void _netintf_update_cb(struct ubus_request *req, int type,
                                           struct blob_attr *msg) {
-    json_tokener *jtok = json_tokener_new();
-
-    char *json_str = blobmsg_format_json(msg, true);
-    nakd_assert(json_str != NULL);
-    if (strlen(json_str) <= 2)
+    json_object *jstate = nakd_blobmsg_to_json(msg);
+    if (jstate == NULL || !json_object_object_length(jstate))
         goto badmsg;
 
-    json_object *jstate = json_tokener_parse_ex(jtok, json_str, strlen(json_str));
-    if (json_tokener_get_error(jtok) != json_tokener_success)
-        goto badmsg;
+    /* built and serialized before anyone else can see it */
+    struct nakd_snapshot *current = nakd_snapshot_create(
+                                    _interface_state(jstate));
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
     pthread_mutex_lock(&_netintf_mutex);
-    if (_previous_netintf_state != NULL)
-        json_object_put(_previous_netintf_state);
-    _previous_netintf_state = _current_netintf_state;
-    _current_netintf_state = jstate;
-    __netintf_diff();    
+    nakd_snapshot_publish(&_netintf_state, current);
+    _netintf_state_updated = now.tv_sec;
     pthread_mutex_unlock(&_netintf_mutex);
-    goto cleanup;
+    *(int *)(req->priv) = 1;
+    return;
 
 badmsg:
     nakd_log(L_WARNING, "Got an unusual response from " NETINTF_UBUS_SERVICE
-                                 " " NETINTF_UBUS_METHOD ": %s.", json_str);
-cleanup:
-    free(json_str);
-    json_tokener_free(jtok);
+                                 " " NETINTF_UBUS_METHOD ": %s.",
+                                  json_object_to_json_string(jstate));
+    json_object_put(jstate);
 }
 
 void nakd_netintf_disable_updates(void) {
@@ -357,6 +336,8 @@ void nakd_netintf_enable_updates(void) {
     nakd_log(L_DEBUG, "Network interface state updates enabled.");
 }
 
+static struct work_desc _retry_desc;
+
 static void _netintf_update(void *priv) {
     pthread_mutex_lock(&_netintf_mutex);
     int updates_disabled = _netintf_updates_disabled;
@@ -364,78 +345,281 @@ static void _netintf_update(void *priv) {
     if (updates_disabled)
         return;
 
-    nakd_ubus_call(NETINTF_UBUS_SERVICE, NETINTF_UBUS_METHOD, "{}", /* all */
-                                         _netintf_update_cb, NULL);
+    int updated = 0;
+    int status = nakd_ubus_call(NETINTF_UBUS_SERVICE, NETINTF_UBUS_METHOD,
+                          "{}" /* all */, _netintf_update_cb, &updated);
+
+    pthread_mutex_lock(&_netintf_mutex);
+    if (!status && updated) {
+        _update_retry = 0;
+    } else if (!_netintf_updates_disabled && !_retry_pending) {
+        /* back off, until it succeeds */
+        _update_retry = _update_retry ? _update_retry * 2 :
+                                         NETINTF_RETRY_INTERVAL;
+        if (_update_retry > NETINTF_RETRY_MAX_INTERVAL)
+            _update_retry = NETINTF_RETRY_MAX_INTERVAL;
+        nakd_log(L_WARNING, "Couldn't update interface state, retrying in "
+                                                 "%d ms.", _update_retry);
+        _retry_pending = 1;
+        nakd_workqueue_submit_delayed(nakd_wq, &_retry_desc, _update_retry);
+    }
+    pthread_mutex_unlock(&_netintf_mutex);
+}
+
+static void _netintf_retry(void *priv) {
+    pthread_mutex_lock(&_netintf_mutex);
+    _retry_pending = 0;
+    pthread_mutex_unlock(&_netintf_mutex);
+
+    _netintf_update(priv);
 }
 
 static struct work_desc _update_desc = {
     .impl = _netintf_update,
-    .name = "netintf update"
+    .name = "netintf update",
+    /* pick up changes made while an update is in progress */
+    .coalesce = WORK_COALESCE_RERUN
+};
+
+static struct work_desc _retry_desc = {
+    .impl = _netintf_retry,
+    .name = "netintf update retry"
 };
 
-static void _netintf_update_sighandler(siginfo_t *timer_info,
-                                  struct nakd_timer *timer) {
-    /* skip, if there's already a pending update in the workqueue */
-    if (!nakd_work_pending(nakd_wq, _update_desc.name)) {
-        struct work *work = nakd_alloc_work(&_update_desc);
-        nakd_workqueue_add(nakd_wq, work);
+static void _queue_update(void) {
+    pthread_mutex_lock(&_netintf_mutex);
+    int retry_pending = _retry_pending;
+    pthread_mutex_unlock(&_netintf_mutex);
+
+    /* the retry picks up whatever changed meanwhile, keep the backoff */
+    if (!retry_pending)
+        nakd_workqueue_submit(nakd_wq, &_update_desc);
+}
+
+static void _carrier_update(const char *ifname, int carrier) {
+    enum nakd_event event_id = EVENT_UNSPECIFIED;
+    enum nakd_interface intf_id = INTF_UNSPECIFIED;
+    int changed = 0;
+
+    pthread_mutex_lock(&_netintf_mutex);
+    for (struct interface *intf = _interfaces; intf->id; intf++) {
+        if (intf->name == NULL || strcmp(intf->name, ifname))
+            continue;
+        if (intf->carrier_state == carrier)
+            continue;
+
+        nakd_log(L_DEBUG, "%s (%s) carrier: %d", nakd_interface_type[intf->id],
+                                                          ifname, carrier);
+        /* no events for initial state */
+        if (intf->carrier != NULL && intf->carrier_state != -1) {
+            event_id = carrier ? intf->carrier->event_carrier_present :
+                                 intf->carrier->event_no_carrier;
+            intf_id = intf->id;
+        }
+        intf->carrier_state = carrier;
+        changed = 1;
+    }
+    pthread_mutex_unlock(&_netintf_mutex);
+
+    if (event_id != EVENT_UNSPECIFIED) {
+        nakd_log(L_DEBUG, "Generating event: %s", nakd_event_name[event_id]);
+        nakd_event_push_data(&(struct event_data){
+            .event = event_id,
+            .interface = intf_id
+        });
+    }
+
+    /* interface_state details come from ubus */
+    if (changed)
+        _queue_update();
+}
+
+static void _handle_link_msg(struct nlmsghdr *nh) {
+    struct ifinfomsg *ifi = NLMSG_DATA(nh);
+    const char *ifname = NULL;
+
+    int len = IFLA_PAYLOAD(nh);
+    for (struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, len);
+                                   rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == IFLA_IFNAME)
+            ifname = RTA_DATA(rta);
     }
+    if (ifname == NULL)
+        return;
+
+    _carrier_update(ifname, nh->nlmsg_type == RTM_NEWLINK &&
+                                (ifi->ifi_flags & IFF_LOWER_UP));
+}
+
+/* Replies come in as RTM_NEWLINK, just like notifications. */
+static void _request_link_dump(void) {
+    struct {
+        struct nlmsghdr nh;
+        struct ifinfomsg ifi;
+    } req = {
+        .nh = {
+            .nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg)),
+            .nlmsg_type = RTM_GETLINK,
+            .nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP
+        },
+        .ifi = {
+            .ifi_family = AF_UNSPEC
+        }
+    };
+
+    if (send(_netlink_fd, &req, req.nh.nlmsg_len, 0) == -1)
+        nakd_log(L_WARNING, "Couldn't request link dump: %s", strerror(errno));
+}
+
+/* Tagged interfaces missing from the dump don't exist, no carrier then. */
+static void _link_dump_done(void) {
+    pthread_mutex_lock(&_netintf_mutex);
+    for (struct interface *intf = _interfaces; intf->id; intf++) {
+        if (intf->name != NULL && intf->carrier_state == -1)
+            intf->carrier_state = 0;
+    }
+    if (!_link_state_synced)
+        nakd_log(L_DEBUG, "Link state synced.");
+    _link_state_synced = 1;
+    pthread_mutex_unlock(&_netintf_mutex);
+}
+
+/* Returns -1 on EINTR and EAGAIN, terminates on anything unexpected. */
+static int _netlink_receive(void) {
+    char buf[NETLINK_BUFSIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+
+    int len = recv(_netlink_fd, buf, sizeof buf, 0);
+    if (len == -1) {
+        if (errno == EINTR || errno == EAGAIN)
+            return -1;
+        if (errno == ENOBUFS) {
+            nakd_log(L_WARNING, "Netlink socket overrun, resyncing "
+                                                   "link state.");
+            _request_link_dump();
+            return 0;
+        }
+        nakd_terminate("recv(): %s", strerror(errno));
+    }
+
+    for (struct nlmsghdr *nh = (struct nlmsghdr *)(buf);
+            NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+        if (nh->nlmsg_type == RTM_NEWLINK ||
+            nh->nlmsg_type == RTM_DELLINK) {
+            _handle_link_msg(nh);
+        } else if (nh->nlmsg_type == NLMSG_DONE) {
+            _link_dump_done();
+        }
+    }
+    return 0;
+}
+
+/*
+ * Carrier state is there once the module's initialized, unless the kernel
+ * takes over NETLINK_SYNC_TIMEOUT - the netlink thread finishes it then.
+ */
+static void _sync_link_state(void) {
+    struct timeval timeout = { .tv_sec = NETLINK_SYNC_TIMEOUT };
+    setsockopt(_netlink_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                                                 sizeof timeout);
+
+    _request_link_dump();
+    while (!nakd_iface_state_available()) {
+        if (_netlink_receive() == -1 && errno == EAGAIN) {
+            nakd_log(L_WARNING, "Link state isn't there yet, continuing.");
+            break;
+        }
+    }
+
+    timeout.tv_sec = 0;
+    setsockopt(_netlink_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                                                 sizeof timeout);
+}
+
+static void _netlink_loop(struct nakd_thread *thread) {
+    while (!_netlink_shutdown) {
+        /* interrupted by NAKD_THREAD_SHUTDOWN_SIGNAL */
+        _netlink_receive();
+    }
+}
+
+static void _netlink_thread_shutdown(struct nakd_thread *thread) {
+    _netlink_shutdown = 1;
+}
+
+static void _create_netlink_socket(void) {
+    nakd_assert((_netlink_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+                                                   NETLINK_ROUTE)) != -1);
+
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = RTMGRP_LINK
+    };
+    nakd_assert(bind(_netlink_fd, (struct sockaddr *)(&addr),
+                                          sizeof addr) != -1);
 }
 
 static int _netintf_init(void) {
     pthread_mutex_init(&_netintf_mutex, NULL);
+    nakd_snapshot_slot_init(&_netintf_state);
     _read_config();
     nakd_netintf_enable_updates();
-    _netintf_update(NULL);
-    _netintf_update_timer = nakd_timer_add(NETINTF_UPDATE_INTERVAL,
-                                 _netintf_update_sighandler, NULL);
+    /* details only, carrier state comes from netlink */
+    _queue_update();
+
+    _create_netlink_socket();
+    _sync_link_state();
+    if (nakd_thread_create_joinable(_netlink_loop, _netlink_thread_shutdown,
+                                                   NULL, &_netintf_thread)) {
+        nakd_terminate("Couldn't create netlink thread.");
+    }
     return 0;
 }
 
 static int _netintf_cleanup(void) {
     nakd_netintf_disable_updates();
-    nakd_timer_remove(_netintf_update_timer);
+    nakd_workqueue_cancel_delayed(nakd_wq, _retry_desc.name);
+    nakd_thread_kill(_netintf_thread);
+    close(_netlink_fd), _netlink_fd = -1;
+    nakd_snapshot_slot_cleanup(&_netintf_state);
     pthread_mutex_destroy(&_netintf_mutex);
     return 0;
 }
 
-json_object *cmd_interface_state(json_object *jcmd, void *arg) {
-    json_object *jresult;
-    json_object *jresponse;
+static int _state_outdated(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
     pthread_mutex_lock(&_netintf_mutex);
-    if (_current_netintf_state == NULL) {
-        jresponse = nakd_jsonrpc_response_error(jcmd, INTERNAL_ERROR,
-                          "Internal error - please try again later");
-        goto unlock;
-    }
-
-    jresult = json_object_new_object();
-    for (struct interface *intf = _interfaces; intf->id; intf++) {
-        json_object *jstate = NULL;
-        if (intf->name != NULL)
-            json_object_object_get_ex(_current_netintf_state, intf->name,
-                                                                &jstate);
-        if (jstate == NULL) {
-            nakd_log(L_DEBUG, "There's no %s interface in current interface "
-                       "status, continuing.", nakd_interface_type[intf->id]);
-        }
+    int outdated = now.tv_sec - _netintf_state_updated >=
+                                   NETINTF_STATE_MAX_AGE;
+    pthread_mutex_unlock(&_netintf_mutex);
+    return outdated;
+}
 
-        json_object_object_add(jresult, nakd_interface_type[intf->id],
-                                          nakd_json_deepcopy(jstate));
+json_object *cmd_interface_state(json_object *jcmd, void *arg) {
+    /*
+     * No more polling, traffic counters are refreshed on demand - in the
+     * background, this request gets the current snapshot.
+     */
+    if (_state_outdated())
+        _queue_update();
+
+    struct nakd_snapshot *state = nakd_snapshot_acquire(&_netintf_state);
+    if (state == NULL) {
+        return nakd_jsonrpc_response_error(jcmd, INTERNAL_ERROR,
+                        "Internal error - please try again later");
     }
 
-    jresponse = nakd_jsonrpc_response_success(jcmd, jresult);
-
-unlock:    
-    pthread_mutex_unlock(&_netintf_mutex);
+    json_object *jresponse = nakd_jsonrpc_response_success(jcmd,
+                                         nakd_snapshot_json(state));
+    nakd_snapshot_put(state);
     return jresponse;
 }
 
 static struct nakd_module module_netintf = {
     .name = "netintf",
-    .deps = (const char *[]){ "uci", "ubus", "event", "timer", "workqueue",
-                                                                    NULL },
+    .deps = (const char *[]){ "uci", "ubus", "event", "thread", "workqueue",
+                                                                     NULL },
     .init = _netintf_init,
     .cleanup = _netintf_cleanup
 };
@@ -78,10 +78,10 @@ struct led_event_notification {
     {}
 };
 
-static void _event_handler(enum nakd_event event, void *priv) {
+static void _event_handler(const struct event_data *data, void *priv) {
     for (struct led_event_notification *notification = _event_notifications;
                                       notification->event; notification++) {
-        if (event == notification->event) {
+        if (data->event == notification->event) {
             if (notification->remove_condition)
                 nakd_led_condition_remove(notification->condition->name);
             else
@@ -1,10 +1,33 @@
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
 #include <json-c/json.h>
 #include "request.h"
 #include "command.h"
 #include "log.h"
 #include "misc.h"
 #include "jsonrpc.h"
+#include "workqueue.h"
+#include "json.h"
+
+#define BATCH_TIMEOUT 20 /* seconds */
+/*
+ * Entries may block a nakd_wq worker for a while, eg. wlan_scan - a batch
+ * gets half of them at most.
+ */
+#define BATCH_MAX_RUNNING (NAKD_DEFAULT_WQ_MAX_THREADS / 2)
+
+static __thread int _client;
+
+void nakd_request_set_client(int client) {
+    _client = client;
+}
+
+int nakd_request_client(void) {
+    return _client;
+}
 
 json_object *nakd_handle_message(json_object *jmsg) {
     nakd_log_execution_point();
@@ -33,6 +56,118 @@ json_object *nakd_handle_single(json_object *jreq) {
     return nakd_call_command(method_name, jreq);
 }
 
+/*
+ * Batch entries are handled concurrently in nakd_wq, up to BATCH_MAX_RUNNING
+ * at a time. An entry which misses the batch deadline keeps running, hence
+ * the reference count - the last one out frees the batch.
+ *
+ * json-c reference counts aren't atomic, so each entry gets a private copy of
+ * its request and drops it before the result is handed over. Nothing else in
+ * the message is touched by workers.
+ */
+struct batch {
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+
+    int count;
+    int pending;
+    json_object **results;
+    int *done;
+
+    int refcount;
+};
+
+struct batch_entry {
+    struct batch *batch;
+    json_object *jreq;
+    int idx;
+    int client;
+};
+
+static struct batch *_alloc_batch(int count) {
+    struct batch *batch = calloc(1, sizeof(struct batch));
+    nakd_assert(batch != NULL);
+    batch->results = calloc(count, sizeof(json_object *));
+    nakd_assert(batch->results != NULL);
+    batch->done = calloc(count, sizeof(int));
+    nakd_assert(batch->done != NULL);
+    batch->count = count;
+
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_condattr_t cv_attr;
+    pthread_condattr_init(&cv_attr);
+    pthread_condattr_setclock(&cv_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&batch->cv, &cv_attr);
+    pthread_condattr_destroy(&cv_attr);
+
+    /* nakd_handle_batch() */
+    batch->refcount = 1;
+    return batch;
+}
+
+static void _free_batch(struct batch *batch) {
+    for (int i = 0; i < batch->count; i++)
+        json_object_put(batch->results[i]);
+    free(batch->results);
+    free(batch->done);
+    pthread_cond_destroy(&batch->cv);
+    pthread_mutex_destroy(&batch->lock);
+    free(batch);
+}
+
+static void _batch_put(struct batch *batch) {
+    pthread_mutex_lock(&batch->lock);
+    int refcount = --batch->refcount;
+    pthread_mutex_unlock(&batch->lock);
+
+    if (!refcount)
+        _free_batch(batch);
+}
+
+static void _handle_batch_entry(void *priv) {
+    struct batch_entry *entry = priv;
+    struct batch *batch = entry->batch;
+
+    nakd_request_set_client(entry->client);
+    json_object *jresult = nakd_handle_single(entry->jreq);
+    nakd_request_set_client(0);
+    /* jresult may share nodes with it, eg. "id" */
+    json_object_put(entry->jreq);
+
+    pthread_mutex_lock(&batch->lock);
+    batch->results[entry->idx] = jresult;
+    batch->done[entry->idx] = 1;
+    batch->pending--;
+    pthread_cond_signal(&batch->cv);
+    pthread_mutex_unlock(&batch->lock);
+
+    _batch_put(batch);
+    free(entry);
+}
+
+/* called with batch->lock held */
+static void __queue_batch_entry(struct batch *batch, json_object *jreq,
+                                                              int idx) {
+    struct batch_entry *entry = malloc(sizeof(struct batch_entry));
+    nakd_assert(entry != NULL);
+    entry->batch = batch;
+    /* jmsg may be freed before a late entry completes */
+    entry->jreq = nakd_json_deepcopy(jreq);
+    entry->idx = idx;
+    entry->client = nakd_request_client();
+
+    batch->refcount++;
+    batch->pending++;
+
+    struct work_desc _entry_desc = {
+        .impl = _handle_batch_entry,
+        .name = "batch entry",
+        .priv = entry,
+        .priority = WORK_PRIORITY_INTERACTIVE
+    };
+    nakd_workqueue_submit(nakd_wq, &_entry_desc);
+}
+
 json_object *nakd_handle_batch(json_object *jmsg) {
     nakd_log_execution_point();
     nakd_assert(jmsg != NULL);
@@ -40,12 +175,58 @@ json_object *nakd_handle_batch(json_object *jmsg) {
     json_object *jresponse = json_object_new_array();
     nakd_assert(jresponse != NULL);
 
-    for (int i = 0; i < json_object_array_length(jmsg); i++) {
-        /* TODO nice to have - process independently in workqueue */
-        json_object *jsingle = json_object_array_get_idx(jmsg, i);
-        json_object *jresult = nakd_handle_single(jsingle);
+    int count = json_object_array_length(jmsg);
+    if (count == 1) {
+        json_object *jresult = nakd_handle_single(
+                json_object_array_get_idx(jmsg, 0));
         if (jresult != NULL)
             json_object_array_add(jresponse, jresult);
+        return jresponse;
+    } else if (!count) {
+        return jresponse;
     }
+
+    struct batch *batch = _alloc_batch(count);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += BATCH_TIMEOUT;
+
+    int queued = 0;
+    pthread_mutex_lock(&batch->lock);
+    for (;;) {
+        while (queued < count && batch->pending < BATCH_MAX_RUNNING) {
+            __queue_batch_entry(batch, json_object_array_get_idx(jmsg,
+                                                     queued), queued);
+            queued++;
+        }
+        if (!batch->pending)
+            break;
+
+        if (pthread_cond_timedwait(&batch->cv, &batch->lock, &deadline)
+                                                        == ETIMEDOUT) {
+            nakd_log(L_WARNING, "Batch request timed out, %d of %d entries "
+                 "unfinished.", batch->pending + count - queued, count);
+            break;
+        }
+    }
+
+    /* gather in request order */
+    for (int i = 0; i < count; i++) {
+        json_object *jsingle = json_object_array_get_idx(jmsg, i);
+        if (batch->done[i]) {
+            if (batch->results[i] != NULL) {
+                json_object_array_add(jresponse, batch->results[i]);
+                batch->results[i] = NULL;
+            }
+        } else if (nakd_jsonrpc_has_id(jsingle)) {
+            json_object_array_add(jresponse, nakd_jsonrpc_response_error(
+                                           jsingle, INTERNAL_ERROR,
+                    "Internal error - batch entry timed out."));
+        }
+    }
+    pthread_mutex_unlock(&batch->lock);
+
+    _batch_put(batch);
     return jresponse;
 }
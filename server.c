@@ -4,12 +4,13 @@
 #include <string.h>
 #include <linux/un.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <errno.h>
+#include <time.h>
+#include <stdint.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <json-c/json.h>
 #include "server.h"
 #include "request.h"
@@ -18,27 +19,105 @@
 #include "jsonrpc.h"
 #include "thread.h"
 #include "module.h"
-
-/* TODO nice to have: implement w/ epoll, threadpool and workqueue */
-
-#define MAX_CONNECTIONS     32
+#include "workqueue.h"
+#include "event.h"
+#include "command.h"
+
+#define MAX_CONNECTIONS     512
+#define LISTEN_BACKLOG      32
+#define MAX_EPOLL_EVENTS    32
+#define CONNECTION_BUF_SIZE 4096
+/* notifications are dropped for clients that don't read them */
+#define MAX_PENDING_OUTPUT  65536
 #define SOCK_PATH      "/run/nakd/nakd.sock"
 
+/* Request handlers may block on synchronous nakd_wq entries, eg. wlan scan,
+ * hence a separate pool. Batch entries do run in nakd_wq, a few at a time -
+ * see nakd_handle_batch().
+ */
+#define SERVER_WQ_MIN_THREADS   1
+#define SERVER_WQ_MAX_THREADS   4
+
 static struct sockaddr_un _nakd_sockaddr;
 static int                _nakd_sockfd;
+static int                _epoll_fd = -1;
+
+/*
+ * Every connection is owned by the event loop in the server thread. At most
+ * one request per connection is being handled in _server_wq at a time - until
+ * its response is sent the socket isn't polled for input, so responses are
+ * sent in request order.
+ */
+
+/* A request left waiting, see nakd_server_defer(). */
+struct deferred_request {
+    nakd_deferred_poll poll;
+    void *priv;
+    /* CLOCK_MONOTONIC, ms */
+    uint64_t deadline;
+    /* handed over to the event loop once the handler returned */
+    int parked;
+    /* set when there might be a response, polled by the event loop */
+    int pending_poll;
+};
+
+static void _free_deferred(struct deferred_request *deferred) {
+    if (deferred != NULL)
+        free(deferred->priv);
+    free(deferred);
+}
 
 struct connection {
-    struct nakd_thread *thread;
+    int id;
     int sockfd;
-    int active;
-    int shutdown;
-} static _connections[MAX_CONNECTIONS];
+
+    json_tokener *jtok;
+    char rbuf[CONNECTION_BUF_SIZE];
+    int rbuf_len;
+    int rbuf_off;
+
+    /* request handled in _server_wq */
+    json_object *jmsg;
+    int busy;
+    int responded;
+    /* holds the _server_wq entry reference while parked */
+    struct deferred_request *deferred;
+
+    /* responses and notifications, filled by workqueue threads */
+    char *wbuf;
+    int wbuf_len;
+    int wbuf_off;
+    int wbuf_size;
+
+    /* bitmask of enum nakd_event, see: cmd_subscribe() */
+    unsigned int subscriptions;
+
+    /* set by the event loop, checked by workqueue threads */
+    int closed;
+    /* protects all of the above except input buffer and tokener */
+    pthread_mutex_t lock;
+
+    /* event loop, _server_wq entry */
+    int refcount;
+
+    struct connection *next;
+    struct connection *prev;
+    /* only used by the event loop, see _expire_deferred() */
+    struct connection *next_expired;
+};
+
+static struct connection *_connections;
+static int _connection_count;
+static int _next_connection_id = 1;
 static pthread_mutex_t _connections_mutex;
 
-static sem_t _connections_sem;
+static struct workqueue *_server_wq;
+/* parked requests, lets the event loop skip looking for deadlines */
+static int _parked_count;
+static struct event_handler *_event_handlers[NAKD_EVENTS];
 
-static pthread_mutex_t _shutdown_mutex;
-static pthread_cond_t _shutdown_cv;
+/* set while a request is being handled, see nakd_server_defer() */
+static __thread struct connection *_current_conn;
 
 static struct nakd_thread *_server_thread;
 static int _server_shutdown;
@@ -47,175 +126,436 @@ static int _unit_initialized;
 
 /* doubly-prefixed functions aren't thread-safe */
 
-static struct connection *__get_connection_slot(void) {
-    struct connection *conn = _connections;
-
-    for (; conn < ARRAY_END(_connections) && conn->active; conn++);
-    if (conn >= ARRAY_END(_connections))
-        return NULL;
-    return conn;
+static uint64_t _ticks(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec) * 1000 + now.tv_nsec / (int)(1e6);
 }
 
-static struct connection *__add_connection(int sock,
-                    struct sockaddr_un *sockaddr) {
-    struct connection *conn;
-    nakd_log_execution_point();
-
-    conn = __get_connection_slot();
-    if (conn == NULL)
-        return NULL;
+static struct connection *__add_connection(int sock) {
+    struct connection *conn = calloc(1, sizeof(struct connection));
+    nakd_assert(conn != NULL);
 
+    conn->id = _next_connection_id++;
     conn->sockfd = sock;
-    conn->active = 1;
-    conn->shutdown = 0;
+    conn->jtok = json_tokener_new();
+    nakd_assert(conn->jtok != NULL);
+    pthread_mutex_init(&conn->lock, NULL);
+    conn->refcount = 1;
+
+    conn->next = _connections;
+    if (_connections != NULL)
+        _connections->prev = conn;
+    _connections = conn;
+    _connection_count++;
     return conn;
 }
 
 static void __free_connection(struct connection *conn) {
-    nakd_log_execution_point();
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        _connections = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    _connection_count--;
+
+    json_object_put(conn->jmsg);
+    _free_deferred(conn->deferred);
+    json_tokener_free(conn->jtok);
+    free(conn->wbuf);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn);
+}
 
-    pthread_mutex_lock(&_shutdown_mutex);
-    conn->active = 0;
-    sem_post(&_connections_sem);
-    pthread_cond_signal(&_shutdown_cv);
-    pthread_mutex_unlock(&_shutdown_mutex);
+static void _connection_get(struct connection *conn) {
+    pthread_mutex_lock(&_connections_mutex);
+    conn->refcount++;
+    pthread_mutex_unlock(&_connections_mutex);
 }
 
-static void __close_connection(struct connection *conn) {
-    nakd_log_execution_point();
+static void _connection_put(struct connection *conn) {
+    pthread_mutex_lock(&_connections_mutex);
+    if (!--conn->refcount)
+        __free_connection(conn);
+    pthread_mutex_unlock(&_connections_mutex);
+}
+
+static void _set_events(struct connection *conn, uint32_t events) {
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = conn
+    };
+    if (epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, conn->sockfd, &ev) == -1) {
+        nakd_log(L_WARNING, "epoll_ctl(): %s, sockfd=%d", strerror(errno),
+                                                            conn->sockfd);
+    }
+}
 
+static struct connection *__connection_byid(int id) {
+    for (struct connection *conn = _connections; conn != NULL;
+                                             conn = conn->next) {
+        if (conn->id == id)
+            return conn;
+    }
+    return NULL;
+}
+
+/* called with conn->lock held */
+static void __update_events(struct connection *conn) {
+    uint32_t events = 0;
+
+    if (!conn->busy)
+        events |= EPOLLIN;
+    /* EPOLLOUT also lets the event loop know the request is complete */
+    if (conn->wbuf_off < conn->wbuf_len || conn->responded)
+        events |= EPOLLOUT;
+    /* and that a parked request is worth another look */
+    if (conn->deferred != NULL && conn->deferred->parked &&
+                              conn->deferred->pending_poll) {
+        events |= EPOLLOUT;
+    }
+    _set_events(conn, events);
+}
+
+/* called with conn->lock held */
+static void __append_output(struct connection *conn, const char *str) {
+    int len = strlen(str);
+
+    if (conn->wbuf_off) {
+        memmove(conn->wbuf, conn->wbuf + conn->wbuf_off,
+                         conn->wbuf_len - conn->wbuf_off);
+        conn->wbuf_len -= conn->wbuf_off;
+        conn->wbuf_off = 0;
+    }
+
+    if (conn->wbuf_len + len > conn->wbuf_size) {
+        int size = conn->wbuf_size ? conn->wbuf_size : CONNECTION_BUF_SIZE;
+        while (size < conn->wbuf_len + len)
+            size *= 2;
+
+        conn->wbuf = realloc(conn->wbuf, size);
+        nakd_assert(conn->wbuf != NULL);
+        conn->wbuf_size = size;
+    }
+
+    memcpy(conn->wbuf + conn->wbuf_len, str, len);
+    conn->wbuf_len += len;
+}
+
+static void _close_connection(struct connection *conn) {
+    nakd_log(L_DEBUG, "Closing connection, sockfd=%d", conn->sockfd);
+
+    pthread_mutex_lock(&conn->lock);
+    conn->closed = 1;
+    epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, conn->sockfd, NULL);
     close(conn->sockfd);
+
+    /* until it's parked, _handle_request() cleans up after it */
+    struct deferred_request *deferred = conn->deferred;
+    if (deferred != NULL && deferred->parked)
+        conn->deferred = NULL;
+    else
+        deferred = NULL;
+    pthread_mutex_unlock(&conn->lock);
+
+    if (deferred != NULL) {
+        __atomic_sub_fetch(&_parked_count, 1, __ATOMIC_RELAXED);
+        _free_deferred(deferred);
+        /* drop the parked request reference */
+        _connection_put(conn);
+    }
+
+    /* drop event loop reference */
+    _connection_put(conn);
 }
 
-static int _message_loop(struct connection *conn) {
-   struct sockaddr_un client_addr;
-    socklen_t client_len = sizeof(struct sockaddr_un);
-    char message_buf[4096];
-    int nb_read = 0, nb_sent;
-    json_tokener *jtok;
-    int nb_parse, parse_offset;
-    json_object *jmsg = NULL;
-    json_object *jresponse = NULL;
-    const char *jrstr;
-    int nb_resp;
-    enum json_tokener_error jerr;
-    int rval = 0;
+/* Called from workqueue threads. jresponse can be NULL, eg. notifications. */
+static void _queue_response(struct connection *conn, json_object *jresponse) {
+    pthread_mutex_lock(&conn->lock);
+    if (conn->closed)
+        goto unlock;
 
-    nakd_log_execution_point();
+    if (jresponse != NULL) {
+        const char *response = json_object_get_string(jresponse);
+        nakd_log(L_DEBUG, "Response: %s", response);
+        __append_output(conn, response);
+    }
 
-    jtok = json_tokener_new();
+    /* the event loop will send the response, then continue parsing */
+    conn->responded = 1;
+    __update_events(conn);
 
-    for (;;) {
-        do {
-            if (conn->shutdown) {
-                nakd_log(L_DEBUG, "Shutting down connection thread, "
-                                          "sockfd=%d", conn->sockfd);
-                goto ret;
-            }
+unlock:
+    pthread_mutex_unlock(&conn->lock);
+}
 
-            if (jerr == json_tokener_continue) {
-                nakd_log(L_DEBUG, "Parsing incoming message, offset: %d",
-                                                      jtok->char_offset);
-                nakd_log(L_DEBUG, "jerr == json_tokener_continue, "
-                                              "reading some more");
-            }
+static void _handle_request(void *priv) {
+    struct connection *conn = priv;
+
+    nakd_request_set_client(conn->id);
+    _current_conn = conn;
+    json_object *jresponse = nakd_handle_message(conn->jmsg);
+    _current_conn = NULL;
+    nakd_request_set_client(0);
+
+    pthread_mutex_lock(&conn->lock);
+    if (conn->deferred != NULL) {
+        if (!conn->closed) {
+            /* the event loop takes over, along with this reference */
+            conn->deferred->parked = 1;
+            __atomic_add_fetch(&_parked_count, 1, __ATOMIC_RELAXED);
+            __update_events(conn);
+            pthread_mutex_unlock(&conn->lock);
+            json_object_put(jresponse);
+            return;
+        }
+        _free_deferred(conn->deferred), conn->deferred = NULL;
+    }
+    pthread_mutex_unlock(&conn->lock);
 
-            /* If there was another JSON string in the middle of the buffer,
-             * start with an offset and don't call recvfrom() just yet.
-             */
-            parse_offset = jtok->char_offset < nb_read ? jtok->char_offset : 0;
-            if (!parse_offset) {
-                /* Don't update nb_read if interrupted. */
-                int rcvfrom_s;
-
-                if ((rcvfrom_s = recvfrom(conn->sockfd, message_buf,
-                      sizeof message_buf, 0, (struct sockaddr *) 
-                              &client_addr, &client_len)) == -1) { 
-                    if (errno == EINTR)
-                        continue;
-
-                    nakd_log(L_NOTICE, "Closing connection (%s)",
-                                              strerror(nb_read));
-                    rval = 1;
-                    goto ret;
-                } else if (!rcvfrom_s) {
-                    /* Handle orderly shutdown. */
-                    nakd_log(L_DEBUG, "Client hung up.");
-                    goto ret;
-                }
-                nb_read = rcvfrom_s;
-                nakd_log(L_DEBUG, "Read %d bytes.", nb_read);
-
-                /* remaining bytes to parse */
-                nb_parse = nb_read;
-            } else {
-                nb_parse = nb_read - jtok->char_offset;
-            }
+    json_object_put(conn->jmsg), conn->jmsg = NULL;
+
+    _queue_response(conn, jresponse);
+    json_object_put(jresponse);
+    _connection_put(conn);
+}
 
-            /* partial JSON strings are stored in tokener context */
-            jmsg = json_tokener_parse_ex(jtok, message_buf + parse_offset,
-                                                                nb_parse);
-        } while ((jerr = json_tokener_get_error(jtok)) == json_tokener_continue);
+/*
+ * Called by the event loop. Completes the parked request if it's got a
+ * response, and always once expired - even if there's nothing to send.
+ */
+static void _poll_deferred(struct connection *conn, int expired) {
+    pthread_mutex_lock(&conn->lock);
+    struct deferred_request *deferred = conn->deferred;
+    if (conn->closed || deferred == NULL || !deferred->parked) {
+        pthread_mutex_unlock(&conn->lock);
+        return;
+    }
 
-        if (jerr == json_tokener_success) {
-            nakd_log(L_DEBUG, "Parsed a complete message of %d bytes.",
-                                                    jtok->char_offset);
+    deferred->pending_poll = 0;
+    json_object *jresponse = deferred->poll(conn->jmsg, expired,
+                                                    deferred->priv);
+    if (jresponse == NULL && !expired) {
+        pthread_mutex_unlock(&conn->lock);
+        return;
+    }
 
-            /* doesn't allocate memory */
-            const char *jmsg_string = json_object_to_json_string(jmsg);
-            nakd_log(L_DEBUG, "Got message: %s", jmsg_string);
+    conn->deferred = NULL;
+    json_object_put(conn->jmsg), conn->jmsg = NULL;
 
-            jresponse = nakd_handle_message(jmsg);
-        } else {
-            nakd_log(L_NOTICE, "Couldn't parse client JSON message: %s.",
-                                          json_tokener_error_desc(jerr));
+    if (jresponse != NULL) {
+        const char *response = json_object_get_string(jresponse);
+        nakd_log(L_DEBUG, "Deferred response: %s", response);
+        __append_output(conn, response);
+    }
+    conn->responded = 1;
+    __update_events(conn);
+    pthread_mutex_unlock(&conn->lock);
 
-            jresponse = nakd_jsonrpc_response_error(NULL, PARSE_ERROR, NULL);
-            json_tokener_reset(jtok);
+    json_object_put(jresponse);
+    __atomic_sub_fetch(&_parked_count, 1, __ATOMIC_RELAXED);
+    _free_deferred(deferred);
+    /* the event loop still holds its own */
+    _connection_put(conn);
+}
+
+/* Returns the epoll_wait() timeout until the next parked request expires. */
+static int _deferred_timeout(void) {
+    if (!__atomic_load_n(&_parked_count, __ATOMIC_RELAXED))
+        return -1;
+
+    uint64_t now = _ticks();
+    int timeout = -1;
+
+    pthread_mutex_lock(&_connections_mutex);
+    for (struct connection *conn = _connections; conn != NULL;
+                                             conn = conn->next) {
+        pthread_mutex_lock(&conn->lock);
+        struct deferred_request *deferred = conn->deferred;
+        if (deferred != NULL && deferred->parked) {
+            int left = deferred->deadline > now ?
+                       deferred->deadline - now : 0;
+            if (timeout == -1 || left < timeout)
+                timeout = left;
         }
+        pthread_mutex_unlock(&conn->lock);
+    }
+    pthread_mutex_unlock(&_connections_mutex);
+    return timeout;
+}
 
-        /* jresponse will be null while handling notifications. */
-        if (jresponse != NULL) {
-            jrstr = json_object_get_string(jresponse);
-
-            while (nb_resp = strlen(jrstr)) {
-                nb_sent = sendto(conn->sockfd, jrstr, nb_resp, 0,
-                              (struct sockaddr *) &client_addr,
-                                                   client_len);
-                if (nb_sent == -1) {
-                    if (errno == EINTR)
-                        continue;
-
-                    nakd_log(L_NOTICE,
-                        "Couldn't send response, closing connection. (%s)",
-                                                          strerror(errno));
-                    rval = 1;
-                    goto ret;
-                }
-                jrstr += nb_sent;
-            }
+/* Answers parked requests past their deadline. */
+static void _expire_deferred(void) {
+    if (!__atomic_load_n(&_parked_count, __ATOMIC_RELAXED))
+        return;
+
+    struct connection *expired = NULL;
+    uint64_t now = _ticks();
 
-            nakd_log(L_DEBUG, "Response sent: %s",
-                json_object_to_json_string(jresponse));
-            json_object_put(jresponse), jresponse = NULL;
+    /* _poll_deferred() can't be called with _connections_mutex held */
+    pthread_mutex_lock(&_connections_mutex);
+    for (struct connection *conn = _connections; conn != NULL;
+                                             conn = conn->next) {
+        pthread_mutex_lock(&conn->lock);
+        struct deferred_request *deferred = conn->deferred;
+        if (deferred != NULL && deferred->parked &&
+                          deferred->deadline <= now) {
+            conn->refcount++;
+            conn->next_expired = expired;
+            expired = conn;
         }
+        pthread_mutex_unlock(&conn->lock);
+    }
+    pthread_mutex_unlock(&_connections_mutex);
 
-        json_object_put(jmsg), jmsg = NULL;
+    while (expired != NULL) {
+        struct connection *conn = expired;
+        expired = conn->next_expired;
+        _poll_deferred(conn, 1);
+        _connection_put(conn);
     }
+}
+
+static void _dispatch_request(struct connection *conn, json_object *jmsg) {
+    /* doesn't allocate memory */
+    nakd_log(L_DEBUG, "Got message: %s", json_object_to_json_string(jmsg));
+
+    conn->jmsg = jmsg;
+
+    /* stop polling for input until the response is sent */
+    pthread_mutex_lock(&conn->lock);
+    conn->busy = 1;
+    __update_events(conn);
+    pthread_mutex_unlock(&conn->lock);
+
+    struct work_desc _request_desc = {
+        .impl = _handle_request,
+        .name = "request",
+        .priv = conn,
+        .priority = WORK_PRIORITY_INTERACTIVE
+    };
+    _connection_get(conn);
+    nakd_workqueue_submit(_server_wq, &_request_desc);
+}
+
+static void _parse_error(struct connection *conn) {
+    enum json_tokener_error jerr = json_tokener_get_error(conn->jtok);
+    nakd_log(L_NOTICE, "Couldn't parse client JSON message: %s.",
+                                  json_tokener_error_desc(jerr));
+    json_tokener_reset(conn->jtok);
 
-ret:
-    /* NULL-safe functions */
+    /* discard the rest of the buffer */
+    conn->rbuf_off = conn->rbuf_len;
+
+    pthread_mutex_lock(&conn->lock);
+    conn->busy = 1;
+    pthread_mutex_unlock(&conn->lock);
+
+    json_object *jresponse = nakd_jsonrpc_response_error(NULL, PARSE_ERROR,
+                                                                     NULL);
+    _queue_response(conn, jresponse);
     json_object_put(jresponse);
-    json_object_put(jmsg);
-    json_tokener_free(jtok);
-    return rval;
+}
+
+/* Parse buffered input until a complete message is dispatched. */
+static void _process_input(struct connection *conn) {
+    while (!conn->busy && conn->rbuf_off < conn->rbuf_len) {
+        int nb_parse = conn->rbuf_len - conn->rbuf_off;
+
+        /* partial JSON strings are stored in tokener context */
+        json_object *jmsg = json_tokener_parse_ex(conn->jtok,
+                         conn->rbuf + conn->rbuf_off, nb_parse);
+        enum json_tokener_error jerr = json_tokener_get_error(conn->jtok);
+
+        if (jerr == json_tokener_continue) {
+            conn->rbuf_off = conn->rbuf_len;
+        } else if (jerr == json_tokener_success) {
+            nakd_log(L_DEBUG, "Parsed a complete message of %d bytes.",
+                                              conn->jtok->char_offset);
+            conn->rbuf_off += conn->jtok->char_offset;
+            json_tokener_reset(conn->jtok);
+            _dispatch_request(conn, jmsg);
+        } else {
+            _parse_error(conn);
+        }
+    }
+}
+
+static void _handle_readable(struct connection *conn) {
+    if (conn->rbuf_off == conn->rbuf_len)
+        conn->rbuf_off = conn->rbuf_len = 0;
+
+    int nb_read = recv(conn->sockfd, conn->rbuf + conn->rbuf_len,
+                       sizeof conn->rbuf - conn->rbuf_len, 0);
+    if (nb_read == -1) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+
+        nakd_log(L_NOTICE, "Closing connection (%s)", strerror(errno));
+        _close_connection(conn);
+        return;
+    } else if (!nb_read) {
+        /* Handle orderly shutdown. */
+        nakd_log(L_DEBUG, "Client hung up.");
+        _close_connection(conn);
+        return;
+    }
+
+    nakd_log(L_DEBUG, "Read %d bytes.", nb_read);
+    conn->rbuf_len += nb_read;
+    _process_input(conn);
+}
+
+static void _handle_writable(struct connection *conn) {
+    pthread_mutex_lock(&conn->lock);
+    while (conn->wbuf_off < conn->wbuf_len) {
+        int nb_sent = send(conn->sockfd, conn->wbuf + conn->wbuf_off,
+                   conn->wbuf_len - conn->wbuf_off, MSG_NOSIGNAL);
+        if (nb_sent == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* stays armed for EPOLLOUT */
+                pthread_mutex_unlock(&conn->lock);
+                return;
+            }
+
+            nakd_log(L_NOTICE, "Couldn't send response, closing connection. "
+                                                   "(%s)", strerror(errno));
+            pthread_mutex_unlock(&conn->lock);
+            _close_connection(conn);
+            return;
+        }
+        conn->wbuf_off += nb_sent;
+    }
+
+    conn->wbuf_off = conn->wbuf_len = 0;
+
+    int completed = conn->responded;
+    if (completed)
+        conn->busy = conn->responded = 0;
+    int poll_deferred = conn->deferred != NULL && conn->deferred->parked &&
+                                               conn->deferred->pending_poll;
+    if (poll_deferred)
+        conn->deferred->pending_poll = 0;
+    __update_events(conn);
+    pthread_mutex_unlock(&conn->lock);
+
+    /* a response is sent in the next round */
+    if (poll_deferred)
+        _poll_deferred(conn, 0);
+    /* there might be another message already buffered */
+    if (completed)
+        _process_input(conn);
 }
 
 static void _create_unix_socket(void) {
     struct stat sock_path_st;
 
     /* Create the nakd server socket. */
-    nakd_assert((_nakd_sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1);
+    nakd_assert((_nakd_sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK
+                                                | SOCK_CLOEXEC, 0)) != -1);
 
     /* Check if SOCK_PATH is strncpy safe. */
     nakd_assert(sizeof SOCK_PATH < UNIX_PATH_MAX);
@@ -240,71 +580,61 @@ static void _create_unix_socket(void) {
     nakd_assert(chmod(SOCK_PATH, 0777) != -1);
 
     /* Listen on local domain socket. */
-    nakd_assert(listen(_nakd_sockfd, MAX_CONNECTIONS) != -1);
+    nakd_assert(listen(_nakd_sockfd, LISTEN_BACKLOG) != -1);
 }
 
-static void _connection_cleanup(void *arg) {
-    struct connection *conn = arg;
-
-    nakd_log_execution_point();
-
+int nakd_active_connections(void) {
     pthread_mutex_lock(&_connections_mutex);
-    __close_connection(conn);
-    __free_connection(conn);
+    int value = _connection_count;
     pthread_mutex_unlock(&_connections_mutex);
+    return value;
 }
 
-static void _connection_setup(struct nakd_thread *thread) {
-    struct connection *conn = thread->priv; 
-
-    nakd_log(L_DEBUG, "Created connection thread, starting message loop");
-
-    pthread_cleanup_push(_connection_cleanup, conn);
-    _message_loop(conn);
-    pthread_cleanup_pop(1);
-}
-
-static void _connection_shutdown(struct nakd_thread *thread) {
-    struct connection *conn = thread->priv;
-    conn->shutdown = 1;
-}
+static void _accept_connections(void) {
+    for (;;) {
+        int c_sock = accept4(_nakd_sockfd, NULL, NULL, SOCK_NONBLOCK |
+                                                          SOCK_CLOEXEC);
+        if (c_sock == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EMFILE || errno == ENFILE) {
+                nakd_log(L_WARNING, "Can't accept new connections (%s)",
+                                                         strerror(errno));
+                return;
+            }
 
-static struct connection *_handle_connection(int sock,
-                       struct sockaddr_un *sockaddr) {
-    struct connection *conn;
+            nakd_terminate("Can't accept new connections (%s)", strerror(errno));
+        }
 
-    nakd_log_execution_point();
+        if (nakd_active_connections() >= MAX_CONNECTIONS) {
+            nakd_log(L_INFO, "Out of connection slots.");
+            close(c_sock);
+            continue;
+        }
 
-    pthread_mutex_lock(&_connections_mutex);
-    conn = __add_connection(sock, sockaddr);
-    if (conn == NULL) {
-        nakd_log(L_INFO, "Out of connection slots.");
-        return NULL;
-    }
+        pthread_mutex_lock(&_connections_mutex);
+        struct connection *conn = __add_connection(c_sock);
+        pthread_mutex_unlock(&_connections_mutex);
+
+        struct epoll_event ev = {
+            .events = EPOLLIN,
+            .data.ptr = conn
+        };
+        if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, c_sock, &ev) == -1) {
+            nakd_log(L_CRIT, "epoll_ctl(): %s", strerror(errno));
+            _close_connection(conn);
+            continue;
+        }
 
-    nakd_log(L_DEBUG, "Creating connection thread");
-    if (nakd_thread_create_detached(_connection_setup,
-                                 _connection_shutdown,
-                               conn, &conn->thread)) {
-        nakd_log(L_CRIT, "Couldn't create a connection thread");
-        conn = NULL;
+        nakd_log(L_INFO, "Connection accepted, %d connection(s) currently "
+                                     "active.", nakd_active_connections());
     }
-
-    pthread_mutex_unlock(&_connections_mutex);
-    return conn;
-}
-
-int nakd_active_connections(void) {
-    int value;
-    sem_getvalue(&_connections_sem, &value);
-    return MAX_CONNECTIONS - value;
 }
 
-static void _accept_loop(void) {
-    int c_sock;
-    pid_t handler_pid;
-    struct sockaddr_un c_sockaddr;
-    socklen_t len = sizeof c_sockaddr;
+static void _event_loop(void) {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
 
     nakd_log_execution_point();
 
@@ -312,23 +642,45 @@ static void _accept_loop(void) {
     if (!_nakd_sockfd)
         _create_unix_socket();
 
-    while(!_server_shutdown) {
-        sem_wait(&_connections_sem);
-        nakd_log(L_DEBUG, "%d connection slot(s) available.",
-                MAX_CONNECTIONS - nakd_active_connections());
-        c_sock = accept(_nakd_sockfd, (struct sockaddr *)(&c_sockaddr), &len);
-        if (c_sock == -1) {
-            sem_post(&_connections_sem);
+    nakd_assert((_epoll_fd = epoll_create1(EPOLL_CLOEXEC)) != -1);
+
+    /* listening socket is the only one registered with a NULL pointer */
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.ptr = NULL
+    };
+    nakd_assert(epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _nakd_sockfd, &ev) != -1);
 
+    while (!_server_shutdown) {
+        /* interrupted by NAKD_THREAD_SHUTDOWN_SIGNAL */
+        int nfds = epoll_wait(_epoll_fd, events, N_ELEMENTS(events),
+                                                  _deferred_timeout());
+        if (nfds == -1) {
             if (errno == EINTR)
                 continue;
 
-            nakd_terminate("Can't accept new connections (%s)", strerror(errno));
+            nakd_terminate("epoll_wait(): %s", strerror(errno));
         }
+        _expire_deferred();
 
-        nakd_log(L_INFO, "Connection accepted, %d connection(s) currently "
-                                     "active.", nakd_active_connections());
-        _handle_connection(c_sock, &c_sockaddr);
+        for (struct epoll_event *event = events; event < events + nfds;
+                                                              event++) {
+            struct connection *conn = event->data.ptr;
+            if (conn == NULL) {
+                _accept_connections();
+                continue;
+            }
+
+            if (event->events & (EPOLLERR | EPOLLHUP) &&
+                         !(event->events & EPOLLIN)) {
+                nakd_log(L_DEBUG, "Client hung up.");
+                _close_connection(conn);
+            } else if (event->events & EPOLLOUT) {
+                _handle_writable(conn);
+            } else if (event->events & EPOLLIN) {
+                _handle_readable(conn);
+            }
+        }
     }
 
     close(_nakd_sockfd);
@@ -337,25 +689,98 @@ static void _accept_loop(void) {
 }
 
 static void _shutdown_connections(void) {
-    for (struct connection *conn = _connections;
-         conn < ARRAY_END(_connections); conn++) {
-        if (conn->active)
-            nakd_thread_kill(conn->thread);
+    nakd_log(L_INFO, "Shutting down connections, %d remaining",
+                                     nakd_active_connections());
+
+    /* can't use _close_connection() here - it may free the entry */
+    pthread_mutex_lock(&_connections_mutex);
+    for (struct connection *conn = _connections; conn != NULL;
+                                             conn = conn->next) {
+        pthread_mutex_lock(&conn->lock);
+        if (!conn->closed) {
+            conn->closed = 1;
+            close(conn->sockfd);
+        }
+        pthread_mutex_unlock(&conn->lock);
     }
+    pthread_mutex_unlock(&_connections_mutex);
 
-    int connections;
-    pthread_mutex_lock(&_shutdown_mutex);
-    while (connections = nakd_active_connections()) {
-        nakd_log(L_INFO, "Shutting down connections, %d remaining", connections);
-        pthread_cond_wait(&_shutdown_cv, &_shutdown_mutex);
+    /* waits for requests being handled at the moment */
+    nakd_workqueue_destroy(&_server_wq);
+
+    pthread_mutex_lock(&_connections_mutex);
+    while (_connections != NULL)
+        __free_connection(_connections);
+    pthread_mutex_unlock(&_connections_mutex);
+
+    close(_epoll_fd), _epoll_fd = -1;
+}
+
+static void _notify_subscribers(const struct event_data *data, void *priv) {
+    enum nakd_event event = data->event;
+
+    json_object *jnotification = json_object_new_object();
+    json_object_object_add(jnotification, "jsonrpc",
+                           json_object_new_string("2.0"));
+    json_object_object_add(jnotification, "method",
+                         json_object_new_string("event"));
+    json_object_object_add(jnotification, "params", nakd_event_json(data));
+    const char *notification = json_object_get_string(jnotification);
+
+    pthread_mutex_lock(&_connections_mutex);
+    for (struct connection *conn = _connections; conn != NULL;
+                                             conn = conn->next) {
+        pthread_mutex_lock(&conn->lock);
+        if (conn->closed)
+            goto next;
+
+        if (conn->deferred != NULL) {
+            conn->deferred->pending_poll = 1;
+            __update_events(conn);
+        }
+
+        if (!(conn->subscriptions & (1U << event)))
+            goto next;
+
+        if (conn->wbuf_len - conn->wbuf_off + strlen(notification) >
+                                               MAX_PENDING_OUTPUT) {
+            nakd_log(L_NOTICE, "Client isn't reading notifications, "
+                    "dropping %s (sockfd=%d)", nakd_event_name[event],
+                                                        conn->sockfd);
+            goto next;
+        }
+
+        __append_output(conn, notification);
+        __update_events(conn);
+next:
+        pthread_mutex_unlock(&conn->lock);
+    }
+    pthread_mutex_unlock(&_connections_mutex);
+
+    json_object_put(jnotification);
+}
+
+static void _add_event_handlers(void) {
+    for (enum nakd_event event = EVENT_UNSPECIFIED + 1;
+             nakd_event_name[event] != NULL; event++) {
+        nakd_assert(event < N_ELEMENTS(_event_handlers));
+        _event_handlers[event] = nakd_event_add_handler(event,
+                                    _notify_subscribers, NULL);
+    }
+}
+
+static void _remove_event_handlers(void) {
+    for (struct event_handler **handler = _event_handlers;
+         handler < ARRAY_END(_event_handlers); handler++) {
+        if (*handler != NULL)
+            nakd_event_remove_handler(*handler), *handler = NULL;
     }
-    pthread_mutex_unlock(&_shutdown_mutex);
 }
 
 /* inside newly-created thread */
 static void _server_thread_setup(struct nakd_thread *thread) {
-    _accept_loop();
-    /* _accept_loop() will return only if _server_shutdown == 1 */
+    _event_loop();
+    /* _event_loop() will return only if _server_shutdown == 1 */
     _shutdown_connections();
 }
 
@@ -377,9 +802,9 @@ static int _create_server_thread(void) {
 static int _server_init(void) {
     if (!_unit_initialized) {
         pthread_mutex_init(&_connections_mutex, NULL);
-        pthread_mutex_init(&_shutdown_mutex, NULL);
-        pthread_cond_init(&_shutdown_cv, NULL);
-        sem_init(&_connections_sem, 0, MAX_CONNECTIONS);
+        nakd_workqueue_create(&_server_wq, SERVER_WQ_MIN_THREADS,
+                                                SERVER_WQ_MAX_THREADS);
+        _add_event_handlers();
 
         _unit_initialized = 1;
         _create_server_thread();
@@ -393,11 +818,9 @@ static int _server_cleanup(void) {
     if (!_unit_initialized)
         return 0;
 
+    _remove_event_handlers();
     nakd_thread_kill(_server_thread);
 
-    sem_destroy(&_connections_sem);
-    pthread_cond_destroy(&_shutdown_cv);
-    pthread_mutex_destroy(&_shutdown_mutex);
     pthread_mutex_destroy(&_connections_mutex);
     _unit_initialized = 0;
     return 0;
@@ -405,9 +828,108 @@ static int _server_cleanup(void) {
 
 static struct nakd_module module_server = {
     .name = "server",
-    .deps = (const char *[]){ "thread", NULL },
+    .deps = (const char *[]){ "thread", "workqueue", "event", NULL },
     .init = _server_init,
     .cleanup = _server_cleanup
 };
 
 NAKD_DECLARE_MODULE(module_server);
+
+int nakd_server_defer(json_object *jcmd, int timeout_ms,
+                     nakd_deferred_poll poll, void *priv) {
+    struct connection *conn = _current_conn;
+    /* batch entries are answered together, by other threads */
+    if (conn == NULL || conn->jmsg != jcmd)
+        return 1;
+    /* notifications aren't answered, there's nothing to wait for */
+    if (!nakd_jsonrpc_has_id(jcmd))
+        return 1;
+
+    struct deferred_request *deferred = calloc(1,
+                         sizeof(struct deferred_request));
+    nakd_assert(deferred != NULL);
+    deferred->poll = poll;
+    deferred->priv = priv;
+    deferred->deadline = _ticks() + timeout_ms;
+    /* catches up with whatever happened before it got parked */
+    deferred->pending_poll = 1;
+
+    pthread_mutex_lock(&conn->lock);
+    nakd_assert(conn->deferred == NULL);
+    conn->deferred = deferred;
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+}
+
+json_object *cmd_subscribe(json_object *jcmd, void *arg) {
+    unsigned int subscriptions = 0;
+
+    int client = nakd_request_client();
+    if (!client) {
+        return nakd_jsonrpc_response_error(jcmd, INTERNAL_ERROR,
+             "Internal error - subscriptions are only available to "
+                                         "socket connections.");
+    }
+
+    json_object *jparams = nakd_jsonrpc_params(jcmd);
+    if (jparams == NULL) {
+        /* all events */
+        subscriptions = ~0U;
+    } else if (json_object_get_type(jparams) == json_type_array) {
+        for (int i = 0; i < json_object_array_length(jparams); i++) {
+            json_object *jevent = json_object_array_get_idx(jparams, i);
+            if (json_object_get_type(jevent) != json_type_string)
+                goto params;
+
+            enum nakd_event event = nakd_event_byname(
+                             json_object_get_string(jevent));
+            if (event == EVENT_UNSPECIFIED)
+                goto params;
+            subscriptions |= 1U << event;
+        }
+    } else {
+        goto params;
+    }
+
+    pthread_mutex_lock(&_connections_mutex);
+    struct connection *conn = __connection_byid(client);
+    if (conn != NULL) {
+        pthread_mutex_lock(&conn->lock);
+        conn->subscriptions = subscriptions;
+        pthread_mutex_unlock(&conn->lock);
+    }
+    pthread_mutex_unlock(&_connections_mutex);
+
+    if (conn == NULL) {
+        return nakd_jsonrpc_response_error(jcmd, INTERNAL_ERROR,
+                        "Internal error - connection closed.");
+    }
+
+    json_object *jresult = json_object_new_array();
+    for (enum nakd_event event = EVENT_UNSPECIFIED + 1;
+             nakd_event_name[event] != NULL; event++) {
+        if (subscriptions & (1U << event)) {
+            json_object_array_add(jresult,
+                json_object_new_string(nakd_event_name[event]));
+        }
+    }
+    return nakd_jsonrpc_response_success(jcmd, jresult);
+
+params:
+    return nakd_jsonrpc_response_error(jcmd, INVALID_PARAMS,
+        "Invalid parameters - params should be an array of event names");
+}
+
+static struct nakd_command subscribe = {
+    .name = "subscribe",
+    .desc = "Streams \"event\" notifications for selected events over this "
+                  "connection. All events if params are omitted, none if "
+                                                            "it's empty.",
+    .usage = "{\"jsonrpc\": \"2.0\", \"method\": \"subscribe\", \"params\":"
+                      " [\"ETHERNET_WAN_PLUGGED\", \"STAGE_CHANGED\"], "
+                                                         "\"id\": 42}",
+    .handler = cmd_subscribe,
+    .access = ACCESS_USER,
+    .module = &module_server
+};
+NAKD_DECLARE_COMMAND(subscribe);
@@ -1,12 +1,19 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <signal.h>
+#include <time.h>
+#include <spawn.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <dirent.h>
 #include <errno.h>
 #include <json-c/json.h>
@@ -14,6 +21,8 @@
 #include "request.h"
 #include "log.h"
 #include "jsonrpc.h"
+#include "workqueue.h"
+#include "helper.h"
 
 #define PIPE_READ       0
 #define PIPE_WRITE      1
@@ -22,6 +31,38 @@
 
 #define NAKD_MAX_ARG_STRLEN 8192
 
+/* output buffers grow by at least that much */
+#define SHELL_OUTPUT_CHUNK 4096
+/* how often to check if the child exited, if there's no pidfd */
+#define SHELL_WAIT_INTERVAL 100 /* ms */
+
+/* up to MAX_SHELL_RESULT_LEN - 1 bytes, the rest is discarded */
+struct shell_output {
+    char *buf;
+    size_t len;
+    size_t size;
+    int truncated;
+};
+
+enum child_state {
+    CHILD_RUNNING,
+    CHILD_EXITED,
+    CHILD_FAILED /* not run, killed or lost along with the helper */
+};
+
+/* Run by the helper, or spawned by us if it isn't available. */
+struct shell_child {
+    const char *name;
+    pid_t pid;
+    int fd; /* helper job socket, or pidfd - closed once finished */
+    int helper;
+    enum child_state state;
+    int wstatus;
+    uint64_t started; /* ms */
+    uint64_t finished;
+    uint64_t deadline; /* killed by us past it, unless run by the helper */
+};
+
 /* create {"/bin/sh", argv[0], ..., argv[n], NULL} on heap */
 static char **build_argv_json(const char *path, json_object *params) {
     int argn = json_object_array_length(params);
@@ -124,13 +165,269 @@ int nakd_shell_exec(const char *cwd, char **output, const char *fmt, ...) {
     return status;
 }
 
-/* Returns NULL if the command failed.
+static int _pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Reads whatever's available, returns 0 once the pipe's closed. */
+static int _read_output(int fd, struct shell_output *out) {
+    for (;;) {
+        if (out->size - out->len <= SHELL_OUTPUT_CHUNK &&
+                          out->size < MAX_SHELL_RESULT_LEN) {
+            size_t size = out->size ? out->size * 2 : SHELL_OUTPUT_CHUNK;
+            if (size > MAX_SHELL_RESULT_LEN)
+                size = MAX_SHELL_RESULT_LEN;
+            out->buf = realloc(out->buf, size);
+            nakd_assert(out->buf != NULL);
+            out->size = size;
+        }
+
+        char discard[SHELL_OUTPUT_CHUNK];
+        char *dst = discard;
+        size_t room = sizeof discard;
+        /* keep room for the terminating null */
+        if (out->len + 1 < out->size) {
+            dst = out->buf + out->len;
+            room = out->size - out->len - 1;
+        }
+
+        ssize_t n = read(fd, dst, room);
+        if (!n)
+            return 0;
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EINTR)
+                return 1;
+            nakd_log(L_WARNING, "Couldn't read command output: %s",
+                                                   strerror(errno));
+            return 0;
+        }
+
+        if (dst != discard) {
+            out->len += n;
+        } else if (!out->truncated) {
+            nakd_log(L_NOTICE, "Command output exceeds %d bytes, truncating.",
+                                                     MAX_SHELL_RESULT_LEN - 1);
+            out->truncated = 1;
+        }
+    }
+}
+
+static char *_output_string(struct shell_output *out) {
+    if (out->buf == NULL)
+        return strdup("");
+
+    out->buf[out->len] = 0;
+    char *str = realloc(out->buf, out->len + 1);
+    return str != NULL ? str : out->buf;
+}
+
+/*
+ * The child gets out_fd as its stdout and stderr, or /dev/null if it's -1,
+ * and an empty signal mask - workers block signals the command shouldn't.
  */
-int nakd_shell_exec_argv(const char **argv, const char *cwd, char **output) {
+pid_t nakd_shell_spawn(const char **argv, const char *cwd, int out_fd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (out_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, 1);
+    } else {
+        posix_spawn_file_actions_addopen(&actions, 1, "/dev/null",
+                                                     O_WRONLY, 0);
+    }
+    posix_spawn_file_actions_adddup2(&actions, 1, 2);
+    if (cwd != NULL)
+        posix_spawn_file_actions_addchdir_np(&actions, cwd);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigset_t defaults;
+    sigfillset(&defaults);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                                        POSIX_SPAWN_SETSIGDEF);
+
     pid_t pid;
-    int pipe_fd[2];
-    char *response = NULL;
-    char *truncated = NULL;
+    int err = posix_spawn(&pid, argv[0], &actions, &attr,
+               (char * const *)(argv), (char * const []){ NULL });
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err) {
+        nakd_log(L_CRIT, "Couldn't spawn %s: %s", argv[1], strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+static uint64_t _ticks(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec) * 1000 + now.tv_nsec / (int)(1e6);
+}
+
+static void _finish_child(struct shell_child *child, enum child_state state) {
+    child->state = state;
+    child->finished = _ticks();
+    if (child->fd != -1)
+        close(child->fd), child->fd = -1;
+}
+
+/* Through the helper if there is one, a 0 timeout_ms means none. */
+static int _start_child(struct shell_child *child, const char **argv,
+                    const char *cwd, int out_fd, int timeout_ms) {
+    *child = (struct shell_child){
+        .name = argv[1],
+        .pid = -1,
+        .started = _ticks()
+    };
+
+    child->fd = nakd_helper_spawn(argv, cwd, out_fd, timeout_ms);
+    if (child->fd != -1) {
+        child->helper = 1;
+        return 0;
+    }
+
+    child->pid = nakd_shell_spawn(argv, cwd, out_fd);
+    if (child->pid == -1) {
+        _finish_child(child, CHILD_FAILED);
+        return -1;
+    }
+    child->fd = _pidfd_open(child->pid);
+    if (timeout_ms)
+        child->deadline = child->started + timeout_ms;
+    return 0;
+}
+
+static void _kill_child(struct shell_child *child) {
+    nakd_log(L_NOTICE, "Canceled, killing %s.", child->name);
+    /* the helper kills it once we hang up */
+    if (!child->helper) {
+        kill(child->pid, SIGKILL);
+        while (waitpid(child->pid, &child->wstatus, 0) == -1 &&
+                                                 errno == EINTR);
+    }
+    _finish_child(child, CHILD_FAILED);
+}
+
+static void _check_child(struct shell_child *child, struct pollfd *pfd) {
+    if (child->helper) {
+        if (pfd->revents) {
+            _finish_child(child, nakd_helper_result(child->fd,
+              &child->wstatus) ? CHILD_FAILED : CHILD_EXITED);
+        }
+        return;
+    }
+
+    pid_t s = waitpid(child->pid, &child->wstatus, WNOHANG);
+    if (s == -1 && errno != EINTR)
+        nakd_terminate("waitpid(): %s", strerror(errno));
+    if (s == child->pid) {
+        _finish_child(child, CHILD_EXITED);
+    } else if (child->deadline && _ticks() >= child->deadline) {
+        nakd_log(L_NOTICE, "%s timed out, killing.", child->name);
+        kill(child->pid, SIGKILL);
+        /* reaped on the next round */
+        child->deadline = 0;
+    }
+}
+
+/* How long to poll for, children we spawned ourselves are timed by us. */
+static int _poll_timeout(struct shell_child *children, int nchildren) {
+    int timeout = -1;
+    uint64_t now = _ticks();
+    for (struct shell_child *child = children;
+              child < children + nchildren; child++) {
+        if (child->state != CHILD_RUNNING || child->helper)
+            continue;
+
+        int wait = -1;
+        if (child->fd == -1)
+            wait = SHELL_WAIT_INTERVAL;
+        if (child->deadline) {
+            int left = child->deadline > now ? child->deadline - now : 0;
+            if (wait == -1 || left < wait)
+                wait = left;
+        }
+        if (wait != -1 && (timeout == -1 || wait < timeout))
+            timeout = wait;
+    }
+    return timeout;
+}
+
+/*
+ * Collects output until the children exit - not until the pipe's closed, a
+ * background process could hold it open. Returns 1 if canceled meanwhile,
+ * the children are killed then.
+ */
+static int _wait_children(struct shell_child *children, int nchildren,
+                                 int out_fd, struct shell_output *out) {
+    struct pollfd *fds = calloc(nchildren + 1, sizeof(struct pollfd));
+    nakd_assert(fds != NULL);
+
+    int canceled = 0;
+    for (;;) {
+        int running = 0;
+        /* negative fds are ignored by poll() */
+        fds[0] = (struct pollfd){ .fd = out_fd, .events = POLLIN };
+        for (int i = 0; i < nchildren; i++) {
+            struct shell_child *child = &children[i];
+            int active = child->state == CHILD_RUNNING;
+            fds[1 + i] = (struct pollfd){
+                .fd = active ? child->fd : -1,
+                .events = POLLIN
+            };
+            running += active;
+        }
+        if (!running)
+            break;
+
+        /* interrupted by the workqueue once the work is canceled */
+        if (poll(fds, nchildren + 1, _poll_timeout(children, nchildren))
+                                                                 == -1) {
+            if (errno != EINTR)
+                nakd_terminate("poll(): %s", strerror(errno));
+            if (nakd_work_canceled()) {
+                for (int i = 0; i < nchildren; i++) {
+                    if (children[i].state == CHILD_RUNNING)
+                        _kill_child(&children[i]);
+                }
+                canceled = 1;
+                break;
+            }
+            continue;
+        }
+
+        if (out_fd != -1 && fds[0].revents && !_read_output(out_fd, out))
+            out_fd = -1;
+
+        for (int i = 0; i < nchildren; i++) {
+            if (children[i].state == CHILD_RUNNING)
+                _check_child(&children[i], &fds[1 + i]);
+        }
+    }
+
+    /* whatever's left */
+    if (!canceled && out_fd != -1)
+        _read_output(out_fd, out);
+    free(fds);
+    return canceled || nakd_work_canceled();
+}
+
+/*
+ * Returns the exit status, -1 if the command failed. If the calling work is
+ * canceled, or NAKD_SHELL_TIMEOUT expires, the command is killed.
+ */
+int nakd_shell_exec_argv(const char **argv, const char *cwd, char **output) {
+    int pipe_fd[2] = { -1, -1 };
+    struct shell_output out = {};
     int status = -1;
 
     nakd_log_execution_point();
@@ -138,79 +435,168 @@ int nakd_shell_exec_argv(const char **argv, const char *cwd, char **output) {
 
     if (argv[1] == NULL) {
         nakd_log(L_CRIT, "argv should hold at least 1 argument.");
-        goto ret;
+        return -1;
     }
 
     if (access(argv[1], X_OK)) {
         nakd_log(L_CRIT, "The file at %s isn't an executable.", argv[1]);
-        goto ret;
+        return -1;
     }
 
-    response = malloc(MAX_SHELL_RESULT_LEN);
-    if (response == NULL) {
-        nakd_log(L_WARNING, "Couldn't allocate %d bytes for command response",
-                                                        MAX_SHELL_RESULT_LEN);
-        goto ret;
+    if (nakd_work_canceled()) {
+        nakd_log(L_NOTICE, "Canceled, not running %s.", argv[1]);
+        return -1;
     }
 
-    memset(response, 0, MAX_SHELL_RESULT_LEN);
-
-    if (pipe(pipe_fd) == -1) {
-        nakd_terminate("pipe()");
-        goto ret;
+    /* not to leak into commands spawned by other workers meanwhile */
+    if (output != NULL) {
+        if (pipe2(pipe_fd, O_CLOEXEC) == -1)
+            nakd_terminate("pipe2(): %s", strerror(errno));
+        fcntl(pipe_fd[PIPE_READ], F_SETFL, O_NONBLOCK);
     }
 
-    pid = fork();
-    if (pid < 0) {
-        goto ret;
-    } else if (pid == 0) { /* child */
-        close(pipe_fd[PIPE_READ]);
-        dup2(pipe_fd[PIPE_WRITE], 1);
-        dup2(pipe_fd[PIPE_WRITE], 2);
+    struct shell_child child;
+    _start_child(&child, argv, cwd, pipe_fd[PIPE_WRITE], NAKD_SHELL_TIMEOUT);
+    if (pipe_fd[PIPE_WRITE] != -1)
+        close(pipe_fd[PIPE_WRITE]);
+    if (child.state == CHILD_FAILED)
+        goto close;
 
-        if (cwd != NULL)
-            chdir(cwd);
-        execve(argv[0], (char * const *)(argv), NULL);
+    if (_wait_children(&child, 1, pipe_fd[PIPE_READ], &out))
+        goto close;
 
-        nakd_terminate("execve()");
-    } else { /* parent */
-        int wstatus;
-        waitpid(pid, &wstatus, WUNTRACED);
-        close(pipe_fd[PIPE_WRITE]);
+    if (child.state == CHILD_EXITED && WIFEXITED(child.wstatus)) {
+        status = WEXITSTATUS(child.wstatus);
+        nakd_log(L_DEBUG, "%s exited with status %d.", argv[1], status);
+    }
 
-        int n;
-        if ((n = read(pipe_fd[PIPE_READ], response, MAX_SHELL_RESULT_LEN - 1) < 0)) {
-            nakd_terminate("read()");
-            goto ret;
-        }
-        response[MAX_SHELL_RESULT_LEN - 1] = 0;
+close:
+    if (pipe_fd[PIPE_READ] != -1)
         close(pipe_fd[PIPE_READ]);
+    if (output != NULL)
+        *output = _output_string(&out);
+    return status;
+}
 
-        if (WIFEXITED(wstatus)) {
-            status = WEXITSTATUS(wstatus);
-            nakd_log(L_DEBUG, "%s exited with status %d.", argv[1], status);
-        }
+struct shell_scripts {
+    char **paths;
+    int count;
+    int size;
+};
+
+static int _collect_script(const char *path, void *priv) {
+    struct shell_scripts *scripts = priv;
+    if (scripts->count == scripts->size) {
+        scripts->size = scripts->size ? scripts->size * 2 : 8;
+        scripts->paths = realloc(scripts->paths,
+                     scripts->size * sizeof(char *));
+        nakd_assert(scripts->paths != NULL);
     }
+    scripts->paths[scripts->count] = strdup(path);
+    nakd_assert(scripts->paths[scripts->count] != NULL);
+    scripts->count++;
+    return 0;
+}
+
+/* eg. 20 for "20dnsmasq.sh", -1 if there's no numeric prefix */
+static long _script_prefix(const char *path) {
+    const char *name = strrchr(path, '/');
+    name = name != NULL ? name + 1 : path;
+    if (!isdigit(*name))
+        return -1;
+    return strtol(name, NULL, 10);
+}
 
-ret:
-    if (response != NULL) {
-        /* truncate */
-        if (output != NULL)
-            *output = strdup(response);
-        free(response);
+/* by prefix, then name - scripts without a prefix go last */
+static int _script_cmp(const void *a, const void *b) {
+    const char *path_a = *(const char **)(a);
+    const char *path_b = *(const char **)(b);
+    long prefix_a = _script_prefix(path_a);
+    long prefix_b = _script_prefix(path_b);
+
+    if (prefix_a != prefix_b) {
+        if (prefix_a == -1)
+            return 1;
+        if (prefix_b == -1)
+            return -1;
+        return prefix_a < prefix_b ? -1 : 1;
     }
-    return status;
+    return strcmp(path_a, path_b);
 }
 
-static int _run_scripts_cb(const char *path, void *priv) {
-    /* disregard positive exit code */
-    nakd_shell_exec(NAKD_SCRIPT_PATH, NULL, path);
-    /* positive return status would stop directory traversal */
-    return 0;
+/* Runs the group concurrently, returns once all of the scripts exit. */
+static int _run_script_group(struct shell_child *children, char **paths,
+                                                                int count) {
+    for (int i = 0; i < count; i++) {
+        nakd_log(L_DEBUG, "Running %s", paths[i]);
+        const char *argv[] = { NAKD_SHELL, paths[i], NULL };
+        _start_child(&children[i], argv, NAKD_SCRIPT_PATH, -1,
+                                             NAKD_SCRIPT_TIMEOUT);
+    }
+    return _wait_children(children, count, -1, NULL);
 }
 
+static void _log_script(struct shell_child *child) {
+    unsigned long ms = child->finished - child->started;
+    if (child->state != CHILD_EXITED) {
+        nakd_log(L_INFO, "  %s: failed, %lu ms", child->name, ms);
+    } else if (WIFEXITED(child->wstatus)) {
+        nakd_log(L_INFO, "  %s: exit status %d, %lu ms", child->name,
+                                    WEXITSTATUS(child->wstatus), ms);
+    } else {
+        nakd_log(L_INFO, "  %s: killed by signal %d, %lu ms", child->name,
+                                              WTERMSIG(child->wstatus), ms);
+    }
+}
+
+/*
+ * Runs the executables in dirpath ordered by their numeric prefix - those
+ * sharing one concurrently, each group once the previous one's done. Exit
+ * statuses are disregarded.
+ */
 int nakd_shell_run_scripts(const char *dirpath) {
-    return nakd_traverse_directory(dirpath, _run_scripts_cb, NULL);
+    struct shell_scripts scripts = {};
+    int status = nakd_traverse_directory(dirpath, _collect_script, &scripts);
+    if (status || !scripts.count)
+        goto free;
+
+    qsort(scripts.paths, scripts.count, sizeof(char *), _script_cmp);
+
+    struct shell_child *children = calloc(scripts.count,
+                                  sizeof(struct shell_child));
+    nakd_assert(children != NULL);
+
+    uint64_t started = _ticks();
+    int ran = 0;
+    while (ran < scripts.count) {
+        int next = ran + 1;
+        long prefix = _script_prefix(scripts.paths[ran]);
+        while (prefix != -1 && next < scripts.count &&
+               _script_prefix(scripts.paths[next]) == prefix) {
+            next++;
+        }
+
+        int canceled = _run_script_group(children + ran,
+                    scripts.paths + ran, next - ran);
+        ran = next;
+        if (canceled) {
+            nakd_log(L_NOTICE, "Canceled, not running scripts in %s any "
+                                                   "further.", dirpath);
+            break;
+        }
+    }
+
+    nakd_log(L_INFO, "Ran %d scripts in %s, %lu ms:", ran, dirpath,
+                               (unsigned long)(_ticks() - started));
+    for (int i = 0; i < ran; i++)
+        _log_script(&children[i]);
+    free(children);
+
+free:
+    for (int i = 0; i < scripts.count; i++)
+        free(scripts.paths[i]);
+    free(scripts.paths);
+    return status;
 }
 
 int nakd_traverse_directory(const char *dirpath, nakd_traverse_cb cb,
@@ -242,6 +628,12 @@ int nakd_traverse_directory(const char *dirpath, nakd_traverse_cb cb,
             continue;
         }
 
+        if (nakd_work_canceled()) {
+            nakd_log(L_NOTICE, "Canceled, not traversing %s any further.",
+                                                                 dirpath);
+            break;
+        }
+
         if (status = cb(path, priv))
             break; 
     }
@@ -279,10 +671,11 @@ json_object *cmd_shell(json_object *jcmd, struct cmd_shell_spec *spec) {
     }
 
     int status;
-    char *output;
+    char *output = NULL;
     if ((status = nakd_shell_exec_argv(argv, spec->cwd, &output)) < 0) {
         nakd_log(L_NOTICE, "Error while running shell command %s", spec->argv[0]);
         jresponse = nakd_jsonrpc_response_error(jcmd, INTERNAL_ERROR, NULL);
+        free(output);
         goto response;
     }
     json_object *jresult = json_object_new_object();
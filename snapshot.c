@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <json-c/json.h>
+#include "snapshot.h"
+#include "log.h"
+
+/* Takes ownership of jstate. */
+struct nakd_snapshot *nakd_snapshot_create(json_object *jstate) {
+    /* not shared yet, the only time jstate is serialized */
+    const char *json = json_object_to_json_string(jstate);
+    int len = strlen(json);
+
+    struct nakd_snapshot *snapshot = malloc(sizeof(struct nakd_snapshot)
+                                                               + len + 1);
+    nakd_assert(snapshot != NULL);
+    snapshot->refcount = 1;
+    snapshot->jstate = jstate;
+    snapshot->len = len;
+    memcpy(snapshot->json, json, len + 1);
+    return snapshot;
+}
+
+void nakd_snapshot_get(struct nakd_snapshot *snapshot) {
+    __sync_add_and_fetch(&snapshot->refcount, 1);
+}
+
+void nakd_snapshot_put(struct nakd_snapshot *snapshot) {
+    if (snapshot == NULL)
+        return;
+
+    if (!__sync_sub_and_fetch(&snapshot->refcount, 1)) {
+        /* last reference, nobody else can see jstate anymore */
+        json_object_put(snapshot->jstate);
+        free(snapshot);
+    }
+}
+
+static void _release_snapshot(json_object *jobject, void *userdata) {
+    nakd_snapshot_put((struct nakd_snapshot *)((char *)(userdata) -
+                           offsetof(struct nakd_snapshot, json)));
+}
+
+/*
+ * Returns a json_object serialized as the snapshot string, as-is. It's meant
+ * to be put in a JSON-RPC response, not to be read. Takes a reference.
+ */
+json_object *nakd_snapshot_json(struct nakd_snapshot *snapshot) {
+    json_object *jobject = json_object_new_object();
+    nakd_assert(jobject != NULL);
+
+    nakd_snapshot_get(snapshot);
+    json_object_set_serializer(jobject, json_object_userdata_to_json_string,
+                                       snapshot->json, _release_snapshot);
+    return jobject;
+}
+
+void nakd_snapshot_slot_init(struct nakd_snapshot_slot *slot) {
+    pthread_mutex_init(&slot->lock, NULL);
+    slot->current = NULL;
+}
+
+void nakd_snapshot_slot_cleanup(struct nakd_snapshot_slot *slot) {
+    nakd_snapshot_put(slot->current);
+    slot->current = NULL;
+    pthread_mutex_destroy(&slot->lock);
+}
+
+/* Takes over the caller's reference. */
+void nakd_snapshot_publish(struct nakd_snapshot_slot *slot,
+                            struct nakd_snapshot *snapshot) {
+    pthread_mutex_lock(&slot->lock);
+    struct nakd_snapshot *previous = slot->current;
+    slot->current = snapshot;
+    pthread_mutex_unlock(&slot->lock);
+
+    /* frees previous state unless a reader still holds it */
+    nakd_snapshot_put(previous);
+}
+
+/* Returns a new reference or NULL, if nothing was published yet. */
+struct nakd_snapshot *nakd_snapshot_acquire(struct nakd_snapshot_slot *slot) {
+    pthread_mutex_lock(&slot->lock);
+    struct nakd_snapshot *snapshot = slot->current;
+    if (snapshot != NULL)
+        nakd_snapshot_get(snapshot);
+    pthread_mutex_unlock(&slot->lock);
+    return snapshot;
+}
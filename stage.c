@@ -16,6 +16,8 @@
 #include "timer.h"
 #include "workqueue.h"
 #include "config.h"
+#include "event.h"
+#include "snapshot.h"
 
 #define NAKD_STAGE_SCRIPT_PATH NAKD_SCRIPT_PATH "stage/"
 #define NAKD_STAGE_SCRIPT_DIR_FMT (NAKD_STAGE_SCRIPT_PATH "%s")
@@ -249,6 +251,9 @@ static struct led_condition _led_stage_working = {
 static struct stage *_current_stage = NULL;
 static struct stage *_requested_stage = NULL;
 
+/* stage_info result, republished after every stage change attempt */
+static struct nakd_snapshot_slot _stage_info;
+
 static void toggle_rule(const char *hook_name, const char *state,
                                     struct uci_option *option) {
     nakd_assert(hook_name != NULL && state != NULL && option != NULL);
@@ -308,6 +313,31 @@ static int _run_uci_hooks(struct stage *stage) {
     return 0;
 }
 
+static json_object *__desc_stage(struct stage *stage) {
+    json_object *jresult = json_object_new_object();
+    json_object *jname = json_object_new_string(stage->name);
+    json_object *jdesc = json_object_new_string(stage->desc);
+    json_object *jconnectivity = json_object_new_string(
+        nakd_connectivity_string[stage->connectivity_level]);
+    json_object *jerr = json_object_new_string(stage->err);
+    json_object_object_add(jresult, "name", jname);
+    json_object_object_add(jresult, "desc", jdesc);
+    json_object_object_add(jresult, "connectivity", jconnectivity);
+    json_object_object_add(jresult, "errmsg", jerr);
+    return jresult;
+}
+
+static json_object *__desc_current_stage(void) {
+    if (_current_stage != NULL)
+        return __desc_stage(_current_stage);
+    return json_object_new_string("No stage set.");
+}
+
+static void __publish_stage_info(void) {
+    nakd_snapshot_publish(&_stage_info,
+           nakd_snapshot_create(__desc_current_stage()));
+}
+
 static void _stage_spec(void *priv) {
     struct stage *stage = *(struct stage **)(priv);
     struct stage *previous = _current_stage;
@@ -340,8 +370,14 @@ static void _stage_spec(void *priv) {
     if (previous != NULL)
         nakd_led_condition_remove(previous->led.name);
     nakd_led_condition_add(&stage->led);
+    nakd_event_push_data(&(struct event_data){
+        .event = STAGE_CHANGED,
+        .previous = previous != NULL ? previous->name : NULL,
+        .current = stage->name
+    });
 
 unlock:
+    __publish_stage_info();
     nakd_led_condition_remove(_led_stage_working.name);
     pthread_mutex_unlock(&_stage_mutex);
 }
@@ -349,18 +385,19 @@ unlock:
 static struct work_desc _stage_work_desc = {
     .impl = _stage_spec,
     .name = "stage",
-    .priv = &_requested_stage
+    .priv = &_requested_stage,
+    /* a stage requested during a change is picked up right after it */
+    .coalesce = WORK_COALESCE_RERUN,
+    .priority = WORK_PRIORITY_BACKGROUND
 };
 
-static void _stage_update_cb(siginfo_t *timer_info,
-                        struct nakd_timer *timer) {
-    pthread_mutex_lock(&_stage_mutex);
-    if (_current_stage != _requested_stage) {
-        if (!nakd_work_pending(nakd_wq, _stage_work_desc.name)) {
-            struct work *stage_wq_entry = nakd_alloc_work(&_stage_work_desc);
-            nakd_workqueue_add(nakd_wq, stage_wq_entry);
-        }
-    }
+static void _stage_update_cb(struct nakd_timer *timer) {
+    /* held during a stage change, don't stall other timers */
+    if (pthread_mutex_trylock(&_stage_mutex))
+        return;
+
+    if (_current_stage != _requested_stage)
+        nakd_workqueue_submit(nakd_wq, &_stage_work_desc);
     pthread_mutex_unlock(&_stage_mutex);
 }
 
@@ -374,6 +411,8 @@ static struct stage *_get_stage(const char *name) {
 
 static int _stage_init(void) {
     pthread_mutex_init(&_stage_mutex, NULL);
+    nakd_snapshot_slot_init(&_stage_info);
+    __publish_stage_info();
 
     char *config_stage;
     nakd_config_key("stage", &config_stage);
@@ -387,7 +426,8 @@ static int _stage_init(void) {
 }
 
 static int _stage_cleanup(void) {
-    timer_delete(_stage_update_timer);
+    nakd_timer_remove(_stage_update_timer);
+    nakd_snapshot_slot_cleanup(&_stage_info);
     pthread_mutex_destroy(&_stage_mutex);
     return 0;
 }
@@ -398,8 +438,7 @@ void nakd_stage_spec(struct stage *stage) {
     nakd_config_set("stage", stage->name);
     pthread_mutex_unlock(&_stage_mutex);
 
-    struct work *stage_wq_entry = nakd_alloc_work(&_stage_work_desc);
-    nakd_workqueue_add(nakd_wq, stage_wq_entry);
+    nakd_workqueue_submit(nakd_wq, &_stage_work_desc);
 }
 
 int nakd_stage(const char *stage_name) {
@@ -451,38 +490,19 @@ static json_object *__desc_stage_step(struct stage_step *step) {
     return jresult;
 }
 
-static json_object *__desc_stage(struct stage *stage) {
-    json_object *jresult = json_object_new_object();
-    json_object *jname = json_object_new_string(stage->name);
-    json_object *jdesc = json_object_new_string(stage->desc);
-    json_object *jconnectivity = json_object_new_string(
-        nakd_connectivity_string[stage->connectivity_level]);
-    json_object *jerr = json_object_new_string(stage->err);
-    json_object_object_add(jresult, "name", jname);
-    json_object_object_add(jresult, "desc", jdesc);
-    json_object_object_add(jresult, "connectivity", jconnectivity);
-    json_object_object_add(jresult, "errmsg", jerr);
-    return jresult;
-}
-
+/* _stage_mutex is held for the whole stage change, don't wait for it. */
 json_object *cmd_stage_info(json_object *jcmd, void *param) {
-    pthread_mutex_lock(&_stage_mutex);
-
-    json_object *jresult;
-    if (_current_stage != NULL)
-        jresult = __desc_stage(_current_stage);
-    else
-        jresult = json_object_new_string("No stage set.");
-
-    json_object *jresponse = nakd_jsonrpc_response_success(jcmd, jresult);
-    pthread_mutex_unlock(&_stage_mutex);
+    struct nakd_snapshot *info = nakd_snapshot_acquire(&_stage_info);
+    json_object *jresponse = nakd_jsonrpc_response_success(jcmd,
+                                          nakd_snapshot_json(info));
+    nakd_snapshot_put(info);
     return jresponse;
 }
 
 static struct nakd_module module_stage = {
     .name = "stage",
     .deps = (const char *[]){ "workqueue", "connectivity", "notification",
-                                                "timer", "config", NULL },
+                                       "timer", "config", "event", NULL },
     .init = _stage_init,
     .cleanup = _stage_cleanup
 };
@@ -35,7 +35,7 @@ static int __active_threads(void) {
     for (struct nakd_thread *thr = _threads;
                   thr < ARRAY_END(_threads);
                                     thr++) {
-        ret += thr->active ? 1 : 0;
+        ret += thr->active && !thr->abandoned ? 1 : 0;
     }
     return ret;
 }
@@ -55,6 +55,7 @@ static void _cleanup_thread(void *priv) {
     nakd_log(L_DEBUG, "Cleaning up thread %d.", thr->tid);
     pthread_mutex_lock(&_threads_mutex);
     thr->active = 0;
+    thr->abandoned = 0;
     pthread_mutex_unlock(&_threads_mutex);
 
     /* see: _wait_for_completion() */
@@ -110,14 +111,15 @@ static int _thread_create(nakd_thread_routine start,
     pthread_mutex_lock(&_threads_mutex);
     struct nakd_thread *thr = __get_thread_slot();
     if (thr == NULL)
-        return 1;
+        goto err;
 
     thr->routine = start;
     thr->shutdown = shutdown;
     thr->priv = priv;
+    thr->abandoned = 0;
 
     if (pthread_create(&thr->tid, &attr, _thread_setup, (void *)(thr)))
-        return 1;
+        goto err;
 
     thr->active = 1;
 
@@ -126,6 +128,10 @@ static int _thread_create(nakd_thread_routine start,
 
     pthread_mutex_unlock(&_threads_mutex);
     return 0;
+
+err:
+    pthread_mutex_unlock(&_threads_mutex);
+    return 1;
 }
 
 int nakd_thread_create_detached(nakd_thread_routine start,
@@ -199,12 +205,24 @@ void nakd_thread_killall(void) {
     for (struct nakd_thread *thr = _threads;
                   thr < ARRAY_END(_threads);
                                     thr++) {
-        if (thr->active)
+        if (thr->active && !thr->abandoned)
             __thread_kill(thr);
     }
     pthread_mutex_unlock(&_threads_mutex);
 }
 
+/*
+ * For threads stuck somewhere they can't be interrupted, or about to exit on
+ * their own. The thread gets detached and isn't waited for at shutdown; its
+ * slot is freed once it returns, if ever.
+ */
+void nakd_thread_abandon(struct nakd_thread *thr) {
+    pthread_mutex_lock(&_threads_mutex);
+    thr->abandoned = 1;
+    pthread_detach(thr->tid);
+    pthread_mutex_unlock(&_threads_mutex);
+}
+
 static int _thread_init(void) {
     if (!_unit_initialized) {
         pthread_key_create(&_tls_data, NULL);
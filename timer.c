@@ -1,122 +1,370 @@
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
-#include <signal.h>
+#include <unistd.h>
 #include <time.h>
 #include <errno.h>
 #include <pthread.h>
-#include "nak_signal.h"
+#include <sys/timerfd.h>
 #include "timer.h"
+#include "thread.h"
 #include "log.h"
 #include "misc.h"
-#include "nak_signal.h"
 #include "module.h"
 
-#define TIMER_SIGNAL SIGALRM
-#define MAX_TIMERS 16
+/*
+ * Hierarchical timer wheel, 1 tick = 1ms of CLOCK_MONOTONIC. Level 0 holds
+ * timers expiring within WHEEL_SIZE ticks, each further level covers
+ * WHEEL_SIZE times as much and is cascaded down as the wheel turns. The
+ * timerfd is armed for the next tick anything has to be done at, so there
+ * are no wakeups in between.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX_DELTA ((uint64_t)(1) << (WHEEL_BITS * WHEEL_LEVELS))
 
-static struct nakd_timer _timers[MAX_TIMERS];
+static struct nakd_timer *_wheel[WHEEL_LEVELS][WHEEL_SIZE];
+/* next tick to be processed */
+static uint64_t _wheel_now;
+static int _wheel_count;
+/* expired, waiting for their handlers to be called */
+static struct nakd_timer *_expired;
+/* the timer whose handler is being called at the moment */
+static struct nakd_timer *_running;
+
+/* Guards the wheel, not held while handlers are called. */
 static pthread_mutex_t _timers_mutex;
+static pthread_cond_t _running_cv;
 
-static struct nakd_timer *__get_timer_slot(void) {
-    struct nakd_timer *timer = _timers;
+static int _timerfd = -1;
+static struct nakd_thread *_timer_thread;
+static int _timer_shutdown;
 
-    for (; timer < ARRAY_END(_timers) && timer->active; timer++);
-    if (timer >= ARRAY_END(_timers))
-        return NULL;
-    return timer;
+static uint64_t _ticks(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec) * 1000 + now.tv_nsec / (int)(1e6);
 }
 
-static int _timer_handler(siginfo_t *siginfo) {
-    if (siginfo->si_signo != TIMER_SIGNAL)
-        return 1;
+static void __link(struct nakd_timer **list, struct nakd_timer *timer) {
+    timer->next = *list;
+    if (*list != NULL)
+        (*list)->pprev = &timer->next;
+    timer->pprev = list;
+    *list = timer;
+}
 
-    pthread_mutex_lock(&_timers_mutex);
-    struct nakd_timer *timer = siginfo->si_value.sival_ptr;
-    /* in case the timer was removed, but a signal is still pending */
-    if (timer->active) {
-        timer->handler(siginfo, timer);
+/* Doesn't update _wheel_count. */
+static void __unlink(struct nakd_timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL, timer->pprev = NULL;
+}
+
+static void __wheel_add(struct nakd_timer *timer) {
+    uint64_t expires = timer->expires;
+    if (expires < _wheel_now)
+        expires = _wheel_now; /* overdue, next turn */
+    uint64_t delta = expires - _wheel_now;
+    if (delta >= WHEEL_MAX_DELTA) {
+        /* parked in the last level, placed again when cascaded */
+        expires = _wheel_now + WHEEL_MAX_DELTA - 1;
+        delta = WHEEL_MAX_DELTA - 1;
     }
-    pthread_mutex_unlock(&_timers_mutex);
-    return 0; /* handled */
+
+    int level = 0;
+    while (delta >= (uint64_t)(1) << (WHEEL_BITS * (level + 1)))
+        level++;
+
+    int idx = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    __link(&_wheel[level][idx], timer);
+    _wheel_count++;
 }
 
-struct nakd_timer *nakd_timer_add(int interval_ms, nakd_timer_handler handler,
-                                                                 void *priv) {
-    pthread_mutex_lock(&_timers_mutex);
+static void __cascade(int level) {
+    int idx = (_wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    struct nakd_timer *timer = _wheel[level][idx];
+    _wheel[level][idx] = NULL;
 
-    struct nakd_timer *timer = __get_timer_slot();
-    if (timer == NULL)
-        nakd_terminate("Out of timer slots");
+    while (timer != NULL) {
+        struct nakd_timer *next = timer->next;
+        _wheel_count--;
+        __wheel_add(timer);
+        timer = next;
+    }
+}
 
-    timer->handler = handler;
-    timer->priv = priv;
-    timer->active = 1;
+/* Moves everything due up to now to _expired. */
+static void __wheel_advance(uint64_t now) {
+    while (_wheel_now <= now) {
+        int idx = _wheel_now & WHEEL_MASK;
+        for (int level = 1; !idx && level < WHEEL_LEVELS; level++) {
+            __cascade(level);
+            idx = (_wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        }
 
-    struct sigevent sev = {
-        .sigev_notify = SIGEV_SIGNAL,
-        .sigev_signo = TIMER_SIGNAL,
-        .sigev_value.sival_ptr = timer
-    };
+        idx = _wheel_now & WHEEL_MASK;
+        while (_wheel[0][idx] != NULL) {
+            struct nakd_timer *timer = _wheel[0][idx];
+            __unlink(timer);
+            _wheel_count--;
+            timer->expired = 1;
+            __link(&_expired, timer);
+        }
+        _wheel_now++;
+    }
+}
 
-    if (timer_create(CLOCK_REALTIME, &sev, &timer->id) == -1)
-        nakd_terminate("Couldn't create a timer. (%s)", strerror(errno));
+/*
+ * Returns the tick the wheel has to be looked at next, 0 if it's empty. A
+ * higher level slot may have to be cascaded before the next level 0 one is
+ * due, it could hold timers expiring in between.
+ */
+static uint64_t __wheel_next(void) {
+    uint64_t next = 0;
+    for (int k = 0; k < WHEEL_SIZE; k++) {
+        if (_wheel[0][(_wheel_now + k) & WHEEL_MASK] != NULL) {
+            next = _wheel_now + k;
+            break;
+        }
+    }
+
+    /* the earliest a higher level slot has to be cascaded */
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        int shift = WHEEL_BITS * level;
+        uint64_t pos = _wheel_now >> shift;
+        for (int k = 1; k <= WHEEL_SIZE; k++) {
+            if (_wheel[level][(pos + k) & WHEEL_MASK] == NULL)
+                continue;
+
+            uint64_t cascade = (pos + k) << shift;
+            if (!next || cascade < next)
+                next = cascade;
+            break;
+        }
+    }
+    return next;
+}
 
+static void __arm_timerfd(void) {
     struct itimerspec its;
     memset(&its, 0, sizeof(struct itimerspec));
 
-    its.it_value.tv_sec = interval_ms / (int)(1e3);
-    its.it_value.tv_nsec = interval_ms % (int)(1e3) * (int)(1e6);
-    its.it_interval.tv_sec = its.it_value.tv_sec;
-    its.it_interval.tv_nsec = its.it_value.tv_nsec;
+    uint64_t next = _expired != NULL ? _wheel_now : __wheel_next();
+    if (next) {
+        its.it_value.tv_sec = next / 1000;
+        its.it_value.tv_nsec = next % 1000 * (int)(1e6);
+    }
 
-    if (timer_settime(timer->id, 0, &its, NULL) == -1)
-        nakd_terminate("Couldn't set timer parameters. (%s)", strerror(errno));
+    if (timerfd_settime(_timerfd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+        nakd_terminate("timerfd_settime(): %s", strerror(errno));
+}
 
-unlock:
+/* Takes the timer off the wheel, or the expired list. */
+static void __timer_detach(struct nakd_timer *timer) {
+    if (timer->pprev == NULL)
+        return;
+
+    if (timer->expired)
+        timer->expired = 0;
+    else
+        _wheel_count--;
+    __unlink(timer);
+}
+
+static void __timer_arm(struct nakd_timer *timer, int delay_ms) {
+    uint64_t now = _ticks();
+    /* nothing to turn the wheel for, catch up at once */
+    if (!_wheel_count && _expired == NULL)
+        _wheel_now = now;
+    timer->expires = now + delay_ms;
+    timer->active = 1;
+    __wheel_add(timer);
+    __arm_timerfd();
+}
+
+static struct nakd_timer *_timer_add(int delay_ms, int interval_ms,
+                            nakd_timer_handler handler, void *priv) {
+    struct nakd_timer *timer = calloc(1, sizeof(struct nakd_timer));
+    nakd_assert(timer != NULL);
+
+    timer->handler = handler;
+    timer->priv = priv;
+    timer->interval = interval_ms;
+
+    pthread_mutex_lock(&_timers_mutex);
+    if (delay_ms >= 0)
+        __timer_arm(timer, delay_ms);
     pthread_mutex_unlock(&_timers_mutex);
     return timer;
 }
 
-void __nakd_timer_remove(struct nakd_timer *timer) {
-    if (!timer->active) {
-        nakd_log(L_WARNING, "Tried to remove nonexistent timer.");
-        return;
+/* Periodic, first called after interval_ms. */
+struct nakd_timer *nakd_timer_add(int interval_ms, nakd_timer_handler handler,
+                                                                 void *priv) {
+    return _timer_add(interval_ms, interval_ms, handler, priv);
+}
+
+/*
+ * Called once, or not at all with a negative delay_ms until armed with
+ * nakd_timer_mod(). The timer is still to be removed with nakd_timer_remove().
+ */
+struct nakd_timer *nakd_timer_add_oneshot(int delay_ms,
+              nakd_timer_handler handler, void *priv) {
+    return _timer_add(delay_ms, 0, handler, priv);
+}
+
+/*
+ * Rearms the timer to be called after delay_ms, a negative delay_ms disarms
+ * it. Never waits for the handler, so it's fine to call with locks the
+ * handler takes held.
+ */
+void nakd_timer_mod(struct nakd_timer *timer, int delay_ms) {
+    pthread_mutex_lock(&_timers_mutex);
+    __timer_detach(timer);
+    if (delay_ms >= 0) {
+        __timer_arm(timer, delay_ms);
+    } else {
+        timer->active = 0;
+        __arm_timerfd();
     }
+    pthread_mutex_unlock(&_timers_mutex);
+}
 
-    timer_delete(timer->id);
-    timer->active = 0;
+/* Whether the timer is waiting to be called, eg. rearmed by its handler. */
+int nakd_timer_armed(struct nakd_timer *timer) {
+    pthread_mutex_lock(&_timers_mutex);
+    int armed = timer->pprev != NULL;
+    pthread_mutex_unlock(&_timers_mutex);
+    return armed;
 }
 
+/*
+ * Once it returns, the handler isn't running anymore and won't be called
+ * again - unless called from the handler itself, which is fine too.
+ */
 void nakd_timer_remove(struct nakd_timer *timer) {
     pthread_mutex_lock(&_timers_mutex);
-    __nakd_timer_remove(timer);
+    __timer_detach(timer);
+    timer->active = 0;
+
+    if (_running == timer) {
+        if (nakd_thread_private() == _timer_thread) {
+            /* freed by _timer_loop() once the handler returns */
+            timer->removed = 1;
+            goto unlock;
+        }
+
+        while (_running == timer)
+            pthread_cond_wait(&_running_cv, &_timers_mutex);
+    }
+    free(timer);
+
+unlock:
     pthread_mutex_unlock(&_timers_mutex);
 }
 
+static void __run_expired(void) {
+    while (_expired != NULL) {
+        struct nakd_timer *timer = _expired;
+        __unlink(timer);
+        timer->expired = 0;
+
+        _running = timer;
+        pthread_mutex_unlock(&_timers_mutex);
+        timer->handler(timer);
+        pthread_mutex_lock(&_timers_mutex);
+        _running = NULL;
+        pthread_cond_broadcast(&_running_cv);
+
+        if (timer->removed) {
+            free(timer);
+        } else if (timer->pprev != NULL) {
+            /* rearmed with nakd_timer_mod() meanwhile */
+        } else if (timer->active && timer->interval) {
+            /* keep the phase, unless we've fallen behind */
+            timer->expires += timer->interval;
+            if (timer->expires < _wheel_now)
+                timer->expires = _wheel_now + timer->interval;
+            __wheel_add(timer);
+        } else {
+            timer->active = 0;
+        }
+    }
+}
+
+static void _timer_loop(struct nakd_thread *thread) {
+    while (!_timer_shutdown) {
+        uint64_t expirations;
+        /* interrupted by NAKD_THREAD_SHUTDOWN_SIGNAL */
+        if (read(_timerfd, &expirations, sizeof expirations) == -1) {
+            if (errno == EINTR)
+                continue;
+            nakd_terminate("read(): %s", strerror(errno));
+        }
+
+        pthread_mutex_lock(&_timers_mutex);
+        __wheel_advance(_ticks());
+        __run_expired();
+        __arm_timerfd();
+        pthread_mutex_unlock(&_timers_mutex);
+    }
+}
+
+static void _timer_thread_shutdown(struct nakd_thread *thread) {
+    _timer_shutdown = 1;
+}
+
 static void _timer_remove_all(void) {
     pthread_mutex_lock(&_timers_mutex);
-    for (struct nakd_timer *timer = _timers; timer < ARRAY_END(_timers);
-                                                              timer++) {
-        if (timer->active)
-            __nakd_timer_remove(timer);
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int idx = 0; idx < WHEEL_SIZE; idx++) {
+            while (_wheel[level][idx] != NULL) {
+                struct nakd_timer *timer = _wheel[level][idx];
+                __unlink(timer);
+                free(timer);
+            }
+        }
+    }
+    while (_expired != NULL) {
+        struct nakd_timer *timer = _expired;
+        __unlink(timer);
+        free(timer);
     }
     pthread_mutex_unlock(&_timers_mutex);
 }
 
 static int _timer_init(void) {
     pthread_mutex_init(&_timers_mutex, NULL);
-    nakd_signal_add_handler(_timer_handler);
+    pthread_cond_init(&_running_cv, NULL);
+
+    _timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (_timerfd == -1)
+        nakd_terminate("timerfd_create(): %s", strerror(errno));
+    _wheel_now = _ticks();
+
+    if (nakd_thread_create_joinable(_timer_loop, _timer_thread_shutdown,
+                                                  NULL, &_timer_thread)) {
+        nakd_terminate("Couldn't create timer thread.");
+    }
     return 0;
 }
 
 static int _timer_cleanup(void) {
+    nakd_thread_kill(_timer_thread);
     _timer_remove_all();
+    close(_timerfd), _timerfd = -1;
+    pthread_cond_destroy(&_running_cv);
     pthread_mutex_destroy(&_timers_mutex);
     return 0;
 }
 
 static struct nakd_module module_timer = {
     .name = "timer",
-    .deps = (const char *[]){ "signal", NULL },
+    .deps = (const char *[]){ "thread", NULL },
     .init = _timer_init,
     .cleanup = _timer_cleanup
 };
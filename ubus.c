@@ -2,8 +2,11 @@
 #include <pthread.h>
 #include <libubox/blobmsg_json.h>
 #include <libubus.h>
+#include <json-c/json.h>
+#include "ubus.h"
 #include "log.h"
 #include "module.h"
+#include "workqueue.h"
 
 #define UBUS_CALL_TIMEOUT 5 * 1000
 
@@ -27,6 +30,13 @@ int nakd_ubus_call(const char *namespace, const char* procedure,
     nakd_assert(namespace != NULL && procedure != NULL &&
                                 arg != NULL && cb!= NULL);
 
+    /* ubus_invoke() retries on EINTR, it's got a timeout of its own though */
+    if (nakd_work_canceled()) {
+        nakd_log(L_NOTICE, "Canceled, skipping ubus call: %s %s", namespace,
+                                                                procedure);
+        return UBUS_STATUS_TIMEOUT;
+    }
+
     /* ubus isn't thread-safe */
     pthread_mutex_lock(&_ubus_mutex);
     /* subsequent inits free previous data */
@@ -62,6 +72,61 @@ unlock:
     return status;
 }
 
+static json_object *_blobmsg_attr_to_json(struct blob_attr *attr);
+
+static json_object *_blobmsg_list_to_json(struct blob_attr *data, int len,
+                                                                int array) {
+    json_object *jresult = array ? json_object_new_array() :
+                                  json_object_new_object();
+
+    struct blob_attr *pos;
+    int rem = len;
+    __blob_for_each_attr(pos, data, rem) {
+        json_object *jvalue = _blobmsg_attr_to_json(pos);
+        if (array)
+            json_object_array_add(jresult, jvalue);
+        else
+            json_object_object_add(jresult, blobmsg_name(pos), jvalue);
+    }
+    return jresult;
+}
+
+static json_object *_blobmsg_attr_to_json(struct blob_attr *attr) {
+    switch (blobmsg_type(attr)) {
+    case BLOBMSG_TYPE_TABLE:
+        return _blobmsg_list_to_json(blobmsg_data(attr),
+                             blobmsg_data_len(attr), 0);
+    case BLOBMSG_TYPE_ARRAY:
+        return _blobmsg_list_to_json(blobmsg_data(attr),
+                             blobmsg_data_len(attr), 1);
+    case BLOBMSG_TYPE_STRING:
+        return json_object_new_string(blobmsg_get_string(attr));
+    case BLOBMSG_TYPE_BOOL:
+        return json_object_new_boolean(blobmsg_get_bool(attr));
+    case BLOBMSG_TYPE_INT16:
+        return json_object_new_int((int16_t)(blobmsg_get_u16(attr)));
+    case BLOBMSG_TYPE_INT32:
+        return json_object_new_int((int32_t)(blobmsg_get_u32(attr)));
+    case BLOBMSG_TYPE_INT64:
+        return json_object_new_int64((int64_t)(blobmsg_get_u64(attr)));
+    case BLOBMSG_TYPE_DOUBLE:
+        return json_object_new_double(blobmsg_get_double(attr));
+    default:
+        /* BLOBMSG_TYPE_UNSPEC, null */
+        return NULL;
+    }
+}
+
+/*
+ * Decodes a ubus reply straight from the blob_attr tree, as
+ * blobmsg_format_json(msg, true) would, but without the text round trip.
+ */
+json_object *nakd_blobmsg_to_json(struct blob_attr *msg) {
+    if (msg == NULL)
+        return NULL;
+    return _blobmsg_list_to_json(blob_data(msg), blob_len(msg), 0);
+}
+
 static int _ubus_cleanup(void) {
     pthread_mutex_destroy(&_ubus_mutex);
 
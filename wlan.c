@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <time.h>
+#include <errno.h>
 #include <pthread.h>
 #include <string.h>
 #include <json-c/json.h>
@@ -15,6 +17,7 @@
 #include "shell.h"
 #include "workqueue.h"
 #include "event.h"
+#include "snapshot.h"
 #include "iwinfo_cli.h"
 
 #define WLAN_NETWORK_LIST_PATH "/etc/nakd/wireless_networks"
@@ -24,6 +27,9 @@
 #define WLAN_SCAN_SERVICE "iwinfo"
 #define WLAN_SCAN_METHOD "scan"
 
+#define WLAN_SCAN_TIMEOUT 10 /* s */
+#define WLAN_SCAN_WAIT_TIMEOUT 30 /* s */
+
 #define WLAN_DEFAULT_INTERFACE "wlan0"
 #define WLAN_AP_DEFAULT_INTERFACE "wlan0"
 
@@ -32,12 +38,36 @@ static pthread_mutex_t _wlan_mutex;
 static const char *_wlan_interface_name;
 static const char *_ap_interface_name;
 
-static json_object *_wireless_networks;
+/* scan results and stored credentials, replaced with _wlan_mutex held */
+static struct nakd_snapshot_slot _wireless_networks;
 static time_t _last_scan;
 
-static json_object *_stored_networks;
+static struct nakd_snapshot_slot _stored_networks;
 static json_object *_current_network;
 
+/*
+ * At most one scan is in flight, callers requesting a scan meanwhile join
+ * it. Scan _scan_last_id is done once _scan_done_id catches up with it.
+ */
+static pthread_mutex_t _scan_mutex;
+/* libiwinfo has global state, held by a scan from backend to finish */
+static pthread_mutex_t _iwinfo_mutex;
+static pthread_cond_t _scan_cv;
+static int _scan_last_id;
+static int _scan_done_id;
+static int _scan_status; /* of _scan_done_id */
+
+/* Only valid with _wlan_mutex held. */
+static json_object *__wireless_networks(void) {
+    if (_wireless_networks.current == NULL)
+        return NULL;
+    return _wireless_networks.current->jstate;
+}
+
+static json_object *__stored_networks(void) {
+    return _stored_networks.current->jstate;
+}
+
 const char *nakd_wlan_interface_name(void) {
     return _wlan_interface_name;
 }
@@ -46,7 +76,7 @@ const char *nakd_ap_interface_name(void) {
     return _ap_interface_name;
 }
 
-static int __read_stored_networks(void) {
+static int __read_stored_networks(json_object **jnetworks) {
     int result = 0;
 
     FILE *fp = fopen(WLAN_NETWORK_LIST_PATH, "r");
@@ -60,7 +90,7 @@ static int __read_stored_networks(void) {
     networks_buffer[size] = 0;
 
     json_tokener *jtok = json_tokener_new();
-    _stored_networks = json_tokener_parse_ex(jtok, networks_buffer, size);
+    *jnetworks = json_tokener_parse_ex(jtok, networks_buffer, size);
     if (json_tokener_get_error(jtok) != json_tokener_success)
         result = 1;
 
@@ -71,16 +101,20 @@ static int __read_stored_networks(void) {
 }
 
 static void __init_stored_networks(void) {
-    if (__read_stored_networks()) {
-            _stored_networks = json_object_new_array();
+    json_object *jnetworks = NULL;
+    if (__read_stored_networks(&jnetworks)) {
+            json_object_put(jnetworks);
+            jnetworks = json_object_new_array();
     }
 
+    nakd_snapshot_publish(&_stored_networks,
+             nakd_snapshot_create(jnetworks));
     nakd_log(L_INFO, "Read %d known networks.",
-        json_object_array_length(_stored_networks)); 
+                json_object_array_length(jnetworks)); 
 }
 
 static void __cleanup_stored_networks(void) {
-    json_object_put(_stored_networks);
+    nakd_snapshot_slot_cleanup(&_stored_networks);
 }
 
 static int __save_stored_networks(void) {
@@ -88,8 +122,8 @@ static int __save_stored_networks(void) {
     if (fp == NULL)
         return 1;
 
-    const char *networks = json_object_get_string(_stored_networks); 
-    fwrite(networks, strlen(networks), 1, fp);
+    struct nakd_snapshot *networks = _stored_networks.current;
+    fwrite(networks->json, networks->len, 1, fp);
     fclose(fp);
     return 0;
 }
@@ -103,10 +137,10 @@ const char *nakd_net_ssid(json_object *jnetwork) {
 }
 
 static json_object *__get_stored_network(const char *ssid) {
-    nakd_assert(_stored_networks != NULL);
+    json_object *jstored = __stored_networks();
 
-    for (int i = 0; i < json_object_array_length(_stored_networks); i++) {
-        json_object *jnetwork = json_object_array_get_idx(_stored_networks, i);
+    for (int i = 0; i < json_object_array_length(jstored); i++) {
+        json_object *jnetwork = json_object_array_get_idx(jstored, i);
         const char *stored_ssid = nakd_net_ssid(jnetwork);
 
         if (stored_ssid == NULL) { 
@@ -120,17 +154,16 @@ static json_object *__get_stored_network(const char *ssid) {
     return NULL;
 }
 
-static void __remove_stored_network(const char *ssid) {
-    nakd_assert(_stored_networks != NULL);
-
-    /* TODO json-c: currently there's no way to remove an array element,
-     * recheck later or patch in json-c.
-     */
-
+/*
+ * Published networks are immutable - copy every entry but ssid's. Shared
+ * nodes would have their json-c refcount touched from multiple threads.
+ */
+static json_object *__copy_stored_networks(const char *ssid) {
+    json_object *jstored = __stored_networks();
     json_object *jupdated = json_object_new_array();
 
-    for (int i = 0; i < json_object_array_length(_stored_networks); i++) {
-        json_object *jnetwork = json_object_array_get_idx(_stored_networks, i);
+    for (int i = 0; i < json_object_array_length(jstored); i++) {
+        json_object *jnetwork = json_object_array_get_idx(jstored, i);
         const char *stored_ssid = nakd_net_ssid(jnetwork);
 
         if (stored_ssid == NULL) { 
@@ -142,22 +175,30 @@ static void __remove_stored_network(const char *ssid) {
             continue;
         }
 
-        json_object_array_add(jupdated, jnetwork);
+        json_object_array_add(jupdated, nakd_json_deepcopy(jnetwork));
     } 
+    return jupdated;
+}
+
+static void __publish_stored_networks(json_object *jnetworks) {
+    nakd_snapshot_publish(&_stored_networks,
+             nakd_snapshot_create(jnetworks));
+}
 
-    json_object_put(_stored_networks);
-    _stored_networks = jupdated;
+static void __remove_stored_network(const char *ssid) {
+    __publish_stored_networks(__copy_stored_networks(ssid));
 
     if (__save_stored_networks())
         nakd_log(L_CRIT, "Couldn't remove stored network credentials: %s", ssid);
 }
 
 static json_object *__find_network(const char *ssid) {
-    if (_wireless_networks == NULL)
+    json_object *jnetworks = __wireless_networks();
+    if (jnetworks == NULL)
         return NULL;
 
-    for (int i = 0; i < json_object_array_length(_wireless_networks); i++) {
-        json_object *jnetwork = json_object_array_get_idx(_wireless_networks, i);
+    for (int i = 0; i < json_object_array_length(jnetworks); i++) {
+        json_object *jnetwork = json_object_array_get_idx(jnetworks, i);
         const char *issid = nakd_json_get_string(jnetwork, "ssid");
         nakd_assert(issid != NULL);
 
@@ -188,8 +229,6 @@ static json_object *_create_network_entry(const char *ssid, const char *key) {
 
 static int __store_network(json_object *jnetwork, const char *key) {
     const char *ssid = nakd_net_ssid(jnetwork);
-    if (__get_stored_network(ssid) != NULL)
-        __remove_stored_network(ssid);
 
     /*
      * Use just ssid and key from user-supplied network entry, copy
@@ -198,7 +237,11 @@ static int __store_network(json_object *jnetwork, const char *key) {
     json_object *jentry = _create_network_entry(ssid, key);
     if (jentry == NULL)
         return 1;
-    json_object_array_add(_stored_networks, jentry);
+
+    /* replaces previously stored credentials, if any */
+    json_object *jupdated = __copy_stored_networks(ssid);
+    json_object_array_add(jupdated, jentry);
+    __publish_stored_networks(jupdated);
 
     if (__save_stored_networks()) {
         nakd_log(L_CRIT, "Couldn't store network credentials for %s", ssid);
@@ -208,11 +251,12 @@ static int __store_network(json_object *jnetwork, const char *key) {
 }
 
 static int __in_range(const char *ssid) {
-    if (_wireless_networks == NULL)
+    json_object *jnetworks = __wireless_networks();
+    if (jnetworks == NULL)
         return -1;
 
-    for (int i = 0; i < json_object_array_length(_wireless_networks); i++) {
-        json_object *jnetwork = json_object_array_get_idx(_wireless_networks, i);
+    for (int i = 0; i < json_object_array_length(jnetworks); i++) {
+        json_object *jnetwork = json_object_array_get_idx(jnetworks, i);
 
         const char *iter_ssid = nakd_net_ssid(jnetwork);
         nakd_assert(iter_ssid != NULL);
@@ -231,11 +275,12 @@ int nakd_wlan_in_range(const char *ssid) {
 }
 
 static json_object *__choose_network(void) {
-    if (_wireless_networks == NULL)
+    json_object *jnetworks = __wireless_networks();
+    if (jnetworks == NULL)
         return NULL;
 
-    for (int i = 0; i < json_object_array_length(_wireless_networks); i++) {
-        json_object *jnetwork = json_object_array_get_idx(_wireless_networks, i);
+    for (int i = 0; i < json_object_array_length(jnetworks); i++) {
+        json_object *jnetwork = json_object_array_get_idx(jnetworks, i);
 
         const char *ssid = nakd_net_ssid(jnetwork);
         nakd_assert(ssid != NULL);
@@ -247,34 +292,26 @@ static json_object *__choose_network(void) {
     return NULL;
 }
 
+/* Returns a copy, owned by the caller. */
 json_object *nakd_wlan_candidate(void) {
     pthread_mutex_lock(&_wlan_mutex);
-    json_object *jnetwork = __choose_network();
+    json_object *jnetwork = nakd_json_deepcopy(__choose_network());
     pthread_mutex_unlock(&_wlan_mutex);
     return jnetwork;
 }
 
 int nakd_wlan_netcount(void) {
-    pthread_mutex_lock(&_wlan_mutex);
-    int count = _wireless_networks == NULL ? 0 :
-        json_object_array_length(_wireless_networks);
-    pthread_mutex_unlock(&_wlan_mutex);
+    struct nakd_snapshot *networks = nakd_snapshot_acquire(
+                                             &_wireless_networks);
+    int count = networks == NULL ? 0 :
+        json_object_array_length(networks->jstate);
+    nakd_snapshot_put(networks);
     return count;
 }
 
 static void _wlan_update_cb(struct ubus_request *req, int type,
                                        struct blob_attr *msg) {
-    json_tokener *jtok = json_tokener_new();
-
-    char *json_str = blobmsg_format_json(msg, true);
-    nakd_assert(json_str != NULL);
-    if (strlen(json_str) <= 2)
-        goto badmsg;
-
-    json_object *jresponse = json_tokener_parse_ex(jtok, json_str, strlen(json_str));
-    if (json_tokener_get_error(jtok) != json_tokener_success)
-        goto badmsg;
-
+    json_object *jresponse = nakd_blobmsg_to_json(msg);
     json_object *jstate = NULL;
     json_object_object_get_ex(jresponse, "results", &jstate); 
     if (jstate == NULL || json_object_get_type(jstate) != json_type_array)
@@ -285,10 +322,13 @@ static void _wlan_update_cb(struct ubus_request *req, int type,
         goto cleanup;
     }
 
+    struct nakd_snapshot *networks = nakd_snapshot_create(
+                                     json_object_get(jstate));
+    json_object_put(jresponse);
+    jresponse = NULL;
+
     pthread_mutex_lock(&_wlan_mutex);
-    if (_wireless_networks != NULL)
-        json_object_put(_wireless_networks);
-    _wireless_networks = jstate;
+    nakd_snapshot_publish(&_wireless_networks, networks);
     _last_scan = time(NULL);
     pthread_mutex_unlock(&_wlan_mutex);
 
@@ -298,10 +338,10 @@ static void _wlan_update_cb(struct ubus_request *req, int type,
 
 badmsg:
     nakd_log(L_WARNING, "Got unusual response from " WLAN_SCAN_SERVICE 
-                              " " WLAN_SCAN_METHOD ": %s.", json_str);
+                              " " WLAN_SCAN_METHOD ": %s.",
+                        json_object_to_json_string(jresponse));
 cleanup:
-    free(json_str);
-    json_tokener_free(jtok);
+    json_object_put(jresponse);
 }
 
 static int _wlan_scan_rpcd(void) {
@@ -431,57 +471,125 @@ static void _wlan_scan_iwinfo_work(void *priv) {
         json_object_array_add(jresults, jnetwork);
     }
 
-    if (_wireless_networks != NULL)
-        json_object_put(_wireless_networks);
-    _wireless_networks = jresults;
+    if (nakd_work_canceled()) {
+        nakd_log(L_NOTICE, "Scan canceled, discarding results.");
+        json_object_put(jresults);
+        scan->status = 1;
+        return;
+    }
+
+    /* results are ready, lock just for the swap */
+    struct nakd_snapshot *networks = nakd_snapshot_create(jresults);
+    pthread_mutex_lock(&_wlan_mutex);
+    nakd_snapshot_publish(&_wireless_networks, networks);
     _last_scan = time(NULL);
+    pthread_mutex_unlock(&_wlan_mutex);
 } 
 
 static void _cleanup_iwinfo_scan(struct iwinfo_scan_priv *scan) {
     free(scan->networks);
+    scan->networks = NULL;
     iwinfo_finish();
 }
 
-static void _wlan_scan_iwinfo_canceled(void *priv) {
-    struct iwinfo_scan_priv *scan = priv;
+/* An abandoned scan finishes late, it's been reported as failed by then. */
+static void _scan_finished(int id, int status) {
+    pthread_mutex_lock(&_scan_mutex);
+    if (id <= _scan_done_id) {
+        pthread_mutex_unlock(&_scan_mutex);
+        return;
+    }
+    _scan_done_id = id;
+    _scan_status = status;
+    nakd_log(L_INFO, "Wireless network scan %d finished, status: %d",
+                                              _scan_done_id, status);
+    pthread_cond_broadcast(&_scan_cv);
+    pthread_mutex_unlock(&_scan_mutex);
+
+    nakd_event_push(WLAN_SCAN_DONE);
+}
 
-    nakd_log(L_INFO, "libiwinfo wireless network scan canceled, cleaning up.");
-    _cleanup_iwinfo_scan(scan);
-} 
+/* priv is the scan id */
+static void _wlan_scan_work(void *priv) {
+    struct iwinfo_scan_priv scan = { .status = 1 };
+
+    /* not waiting, it could take as long as the abandoned scan's stuck */
+    if (pthread_mutex_trylock(&_iwinfo_mutex)) {
+        nakd_log(L_WARNING, "An abandoned scan is still using libiwinfo, "
+                                                        "not scanning.");
+    } else {
+        _wlan_scan_iwinfo_work(&scan);
+        _cleanup_iwinfo_scan(&scan);
+        pthread_mutex_unlock(&_iwinfo_mutex);
+    }
+    _scan_finished((intptr_t)(priv), scan.status);
+}
+
+/*
+ * The worker stuck in scanlist() was abandoned, let the waiters go. The
+ * scan cleans up after itself if it ever returns, scans started meanwhile
+ * fail rather than share libiwinfo with it.
+ */
+static void _wlan_scan_canceled(void *priv) {
+    nakd_log(L_INFO, "libiwinfo wireless network scan %d abandoned.",
+                                                (int)(intptr_t)(priv));
+    _scan_finished((intptr_t)(priv), 1);
+}
 
-static struct iwinfo_scan_priv _iwinfo_scan_priv;
 static struct work_desc _iwinfo_scan_desc = {
-    .impl = _wlan_scan_iwinfo_work,
-    .canceled = _wlan_scan_iwinfo_canceled,
+    .impl = _wlan_scan_work,
+    .canceled = _wlan_scan_canceled,
     .name = "wlan scan",
-    .synchronous = 1,
-    .timeout = 10,
-    .priv = &_iwinfo_scan_priv
+    .timeout = WLAN_SCAN_TIMEOUT,
+    .priority = WORK_PRIORITY_BACKGROUND
 };
 
-static int _wlan_scan_iwinfo(void) {
-    int status;
-    struct work *scan_wq_entry = nakd_alloc_work(&_iwinfo_scan_desc);
-
-    pthread_mutex_lock(&_wlan_mutex);
-    nakd_workqueue_add(nakd_wq, scan_wq_entry);
-    if (scan_wq_entry->status == WORK_CANCELED) {
-        status = 1;
-        goto unlock;
+/* Starts a scan or joins the one in flight, returns its id. */
+int nakd_wlan_scan_start(void) {
+    pthread_mutex_lock(&_scan_mutex);
+    if (_scan_last_id == _scan_done_id) {
+        _scan_last_id++;
+        nakd_log(L_INFO, "Scanning for wireless networks. (scan %d)",
+                                                      _scan_last_id);
+        struct work_desc desc = _iwinfo_scan_desc;
+        desc.priv = (void *)(intptr_t)(_scan_last_id);
+        nakd_workqueue_submit(nakd_wq, &desc);
+    } else {
+        nakd_log(L_DEBUG, "Joining wireless network scan %d.",
+                                               _scan_last_id);
     }
+    int id = _scan_last_id;
+    pthread_mutex_unlock(&_scan_mutex);
+    return id;
+}
 
-    status = _iwinfo_scan_priv.status;
-    _cleanup_iwinfo_scan(&_iwinfo_scan_priv);
+/*
+ * Returns 0 if the scan succeeded, 1 if it failed and -1 if it didn't finish
+ * within WLAN_SCAN_WAIT_TIMEOUT.
+ */
+int nakd_wlan_scan_wait(int id) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += WLAN_SCAN_WAIT_TIMEOUT;
+
+    int status = 0;
+    pthread_mutex_lock(&_scan_mutex);
+    while (_scan_done_id < id) {
+        if (pthread_cond_timedwait(&_scan_cv, &_scan_mutex,
+                                   &deadline) == ETIMEDOUT) {
+            status = -1;
+            goto unlock;
+        }
+    }
+    status = _scan_status;
 
 unlock:
-    pthread_mutex_unlock(&_wlan_mutex);
-    nakd_free_work(scan_wq_entry);
+    pthread_mutex_unlock(&_scan_mutex);
     return status;
 }
 
 int nakd_wlan_scan(void) {
-    nakd_log(L_INFO, "Scanning for wireless networks."); 
-    _wlan_scan_iwinfo();
+    return nakd_wlan_scan_wait(nakd_wlan_scan_start());
 }
 
 const char *nakd_net_encryption(json_object *jnetwork) {
@@ -573,16 +681,14 @@ unlock:
 static void __swap_current_network(json_object *jnetwork) {
     if (_current_network != NULL)
         json_object_put(_current_network);
-    if (jnetwork != NULL)
-        json_object_get(jnetwork);
-    _current_network = jnetwork;
+    /* jnetwork may be a part of a request, owned by another thread */
+    _current_network = nakd_json_deepcopy(jnetwork);
 }
 
+/* Returns a copy, owned by the caller. */
 json_object *nakd_wlan_current(void) {
     pthread_mutex_lock(&_wlan_mutex);
-    if (_current_network != NULL)
-        json_object_get(_current_network);
-    json_object *jnetwork = _current_network;
+    json_object *jnetwork = nakd_json_deepcopy(_current_network);
     pthread_mutex_unlock(&_wlan_mutex);
     return jnetwork;
 }
@@ -663,6 +769,17 @@ unlock:
 
 static int _wlan_init(void) {
     pthread_mutex_init(&_wlan_mutex, NULL);
+    pthread_mutex_init(&_scan_mutex, NULL);
+    pthread_mutex_init(&_iwinfo_mutex, NULL);
+
+    pthread_condattr_t cv_attr;
+    pthread_condattr_init(&cv_attr);
+    pthread_condattr_setclock(&cv_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_scan_cv, &cv_attr);
+    pthread_condattr_destroy(&cv_attr);
+
+    nakd_snapshot_slot_init(&_wireless_networks);
+    nakd_snapshot_slot_init(&_stored_networks);
     if ((_wlan_interface_name = nakd_interface_name(NAKD_WLAN)) == NULL) {
         nakd_log(L_WARNING, "Couldn't get %s interface name from UCI, "
                      "continuing with default " WLAN_DEFAULT_INTERFACE,
@@ -691,61 +808,104 @@ static int _wlan_init(void) {
 
 static int _wlan_cleanup(void) {
     __cleanup_stored_networks();
+    nakd_snapshot_slot_cleanup(&_wireless_networks);
+    json_object_put(_current_network);
+    pthread_cond_destroy(&_scan_cv);
+    pthread_mutex_destroy(&_iwinfo_mutex);
+    pthread_mutex_destroy(&_scan_mutex);
     pthread_mutex_destroy(&_wlan_mutex);
     return 0;
 }
 
+/* Serves the last published scan results, never waits for a scan. */
 json_object *cmd_wlan_list(json_object *jcmd, void *arg) {
-    json_object *jresponse;
-
-    pthread_mutex_lock(&_wlan_mutex);
-    if (_wireless_networks == NULL) {
-        jresponse = nakd_jsonrpc_response_error(jcmd, INTERNAL_ERROR,
-                           "Internal error - no cached scan results,"
-                                           " call wlan_scan first.");
-        goto unlock;
+    struct nakd_snapshot *networks = nakd_snapshot_acquire(
+                                             &_wireless_networks);
+    if (networks == NULL) {
+        return nakd_jsonrpc_response_error(jcmd, INTERNAL_ERROR,
+                         "Internal error - no cached scan results,"
+                                         " call wlan_scan first.");
     }
 
-    jresponse = nakd_jsonrpc_response_success(jcmd,
-           nakd_json_deepcopy(_wireless_networks));
-
-unlock:
-    pthread_mutex_unlock(&_wlan_mutex);
+    json_object *jresponse = nakd_jsonrpc_response_success(jcmd,
+                                      nakd_snapshot_json(networks));
+    nakd_snapshot_put(networks);
     return jresponse;
 }
 
 json_object *cmd_wlan_list_stored(json_object *jcmd, void *arg) {
-    json_object *jresponse;
-
-    pthread_mutex_lock(&_wlan_mutex);
-    jresponse = nakd_jsonrpc_response_success(jcmd,
-             nakd_json_deepcopy(_stored_networks));
-
-unlock:
-    pthread_mutex_unlock(&_wlan_mutex);
+    struct nakd_snapshot *networks = nakd_snapshot_acquire(
+                                               &_stored_networks);
+    json_object *jresponse = nakd_jsonrpc_response_success(jcmd,
+                                      nakd_snapshot_json(networks));
+    nakd_snapshot_put(networks);
     return jresponse;
 }
 
-json_object *cmd_wlan_scan(json_object *jcmd, void *arg) {
-    json_object *jresponse;
-
-    if (nakd_wlan_scan()) {
-        jresponse = nakd_jsonrpc_response_error(jcmd, INTERNAL_ERROR,
+static json_object *_scan_response(json_object *jcmd, int id) {
+    if (nakd_wlan_scan_wait(id)) {
+        return nakd_jsonrpc_response_error(jcmd, INTERNAL_ERROR,
            "Internal error - couldn't update wireless network list");
-        return jresponse;
     }
 
     int netcount = nakd_wlan_netcount();
 
     json_object *jresult = json_object_new_object();
+    json_object *jscanid = json_object_new_int(id);
     json_object *jnetcount = json_object_new_int(netcount);
     json_object *jlastscan = json_object_new_int(_last_scan);
+    json_object_object_add(jresult, "scan_id", jscanid);
     json_object_object_add(jresult, "netcount", jnetcount);
     json_object_object_add(jresult, "last_scan", jlastscan);
 
     return nakd_jsonrpc_response_success(jcmd, jresult);
 }
 
+json_object *cmd_wlan_scan(json_object *jcmd, void *arg) {
+    json_object *jparams = nakd_jsonrpc_params(jcmd);
+    json_object *jasync = NULL;
+    /* anything else in params is ignored, eg. {} or [] */
+    if (jparams != NULL && json_object_get_type(jparams) == json_type_object)
+        json_object_object_get_ex(jparams, "async", &jasync);
+    if (jasync != NULL && json_object_get_type(jasync) != json_type_boolean) {
+        return nakd_jsonrpc_response_error(jcmd, INVALID_PARAMS,
+                   "Invalid parameters - \"async\" should be a boolean");
+    }
+
+    int id = nakd_wlan_scan_start();
+    if (jasync == NULL || !json_object_get_boolean(jasync))
+        return _scan_response(jcmd, id);
+
+    /* WLAN_SCAN_DONE event is pushed once it's finished */
+    json_object *jresult = json_object_new_object();
+    json_object_object_add(jresult, "scan_id", json_object_new_int(id));
+    return nakd_jsonrpc_response_success(jcmd, jresult);
+}
+
+json_object *cmd_wlan_scan_wait(json_object *jcmd, void *arg) {
+    json_object *jparams = nakd_jsonrpc_params(jcmd);
+    json_object *jscanid = NULL;
+    if (jparams != NULL && json_object_get_type(jparams) == json_type_object)
+        json_object_object_get_ex(jparams, "scan_id", &jscanid);
+
+    if (jscanid == NULL || json_object_get_type(jscanid) != json_type_int) {
+        return nakd_jsonrpc_response_error(jcmd, INVALID_PARAMS,
+             "Invalid parameters - params should be an object with"
+                                       " integer \"scan_id\" member");
+    }
+
+    int id = json_object_get_int(jscanid);
+    pthread_mutex_lock(&_scan_mutex);
+    int started = id > 0 && id <= _scan_last_id;
+    pthread_mutex_unlock(&_scan_mutex);
+    if (!started) {
+        return nakd_jsonrpc_response_error(jcmd, INVALID_PARAMS,
+                               "Invalid parameters - no such scan");
+    }
+
+    return _scan_response(jcmd, id);
+}
+
 json_object *cmd_wlan_connect(json_object *jcmd, void *arg) {
     json_object *jresponse;
     json_object *jparams;
@@ -768,7 +928,7 @@ json_object *cmd_wlan_connect(json_object *jcmd, void *arg) {
        }
     }
 
-    if (_wireless_networks == NULL) {
+    if (__wireless_networks() == NULL) {
         jresponse = nakd_jsonrpc_response_error(jcmd, INTERNAL_ERROR,
                            "Internal error - no cached scan results,"
                                            " call wlan_scan first.");
@@ -786,7 +946,11 @@ json_object *cmd_wlan_connect(json_object *jcmd, void *arg) {
         goto unlock;
     }
 
-    nakd_event_push(CONNECTIVITY_OK);
+    nakd_event_push_data(&(struct event_data){
+        .event = CONNECTIVITY_OK,
+        .interface = NAKD_WLAN,
+        .ssid = ssid
+    });
 
     if (jstore != NULL) {
        if (json_object_get_boolean(jstore)) {
@@ -847,7 +1011,8 @@ unlock:
 
 static struct nakd_module module_wlan = {
     .name = "wlan",
-    .deps = (const char *[]){ "uci", "ubus", "netintf", "workqueue", NULL },
+    .deps = (const char *[]){ "uci", "ubus", "netintf", "workqueue", "event",
+                                                                     NULL },
     .init = _wlan_init,
     .cleanup = _wlan_cleanup 
 };
@@ -867,14 +1032,28 @@ NAKD_DECLARE_COMMAND(wlan_connect);
 
 static struct nakd_command wlan_scan = {
     .name = "wlan_scan",
-    .desc = "Triggers wireless network scan. Does not return results.",
-    .usage = "{\"jsonrpc\": \"2.0\", \"method\": \"wlan_scan\", \"id\": 42}",
+    .desc = "Triggers wireless network scan, or joins the one in progress. "
+                  "Does not return results. With \"async\" set, returns "
+                                      "scan_id without waiting for it.",
+    .usage = "{\"jsonrpc\": \"2.0\", \"method\": \"wlan_scan\", \"params\":"
+                                          " {\"async\": true}, \"id\": 42}",
     .handler = cmd_wlan_scan,
     .access = ACCESS_ROOT,
     .module = &module_wlan
 };
 NAKD_DECLARE_COMMAND(wlan_scan);
 
+static struct nakd_command wlan_scan_wait = {
+    .name = "wlan_scan_wait",
+    .desc = "Waits for an asynchronous wireless network scan to finish.",
+    .usage = "{\"jsonrpc\": \"2.0\", \"method\": \"wlan_scan_wait\", "
+                               "\"params\": {\"scan_id\": 1}, \"id\": 42}",
+    .handler = cmd_wlan_scan_wait,
+    .access = ACCESS_ROOT,
+    .module = &module_wlan
+};
+NAKD_DECLARE_COMMAND(wlan_scan_wait);
+
 static struct nakd_command wlan_list = {
     .name = "wlan_list",
     .desc = "Returns cached wireless network list.",
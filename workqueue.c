@@ -1,6 +1,5 @@
 #include <stdlib.h>
 #include <time.h>
-#include <setjmp.h>
 #include <errno.h>
 #include <pthread.h>
 #include <signal.h>
@@ -11,10 +10,23 @@
 #include "log.h"
 #include "module.h"
 #include "timer.h"
+#include "config.h"
+#include "command.h"
+#include "jsonrpc.h"
 
+/* interrupts blocking calls of canceled entries */
 #define WQ_CANCEL_SIGNAL SIGCONT
-
-#define TIMEOUT_CHECK_INTERVAL 2500 /* ms */
+/* canceled entries' workers are signaled that often until they return */
+#define WQ_CANCEL_KICK_INTERVAL 1000 /* ms */
+/* the worker is replaced if a canceled entry doesn't return by then */
+#define WQ_ABANDON_GRACE 5000 /* ms */
+/* per workqueue, recycled entries above that are freed */
+#define WQ_FREELIST_MAX 32
+/* workers above the minimum exit once idle for that long */
+#define WQ_IDLE_TIMEOUT 30000 /* ms */
+#define WQ_STATS_BUCKETS 32
+/* bucket n counts durations below 2^n us, the last one everything else */
+#define WQ_STATS_HISTOGRAM 28
 
 /* provide a default, daemon-wide workqueue */
 struct workqueue *nakd_wq;
@@ -22,74 +34,309 @@ struct workqueue *nakd_wq;
 struct worker_thread_priv {
     struct workqueue *wq;
     struct work *current;
+    /* stuck in current, replaced by another worker */
+    int abandoned;
+    /*
+     * Set while the timeout handler calls current's canceled(). Whichever of
+     * the two is done last frees current, along with this struct.
+     */
+    int canceled_pending;
+    int returned;
+    struct worker_thread_priv *next_abandoned;
+};
+
+/* highest priority first */
+static const enum work_priority _dequeue_order[] = {
+    WORK_PRIORITY_INTERACTIVE,
+    WORK_PRIORITY_EVENT,
+    WORK_PRIORITY_BACKGROUND
 };
 
+static struct workqueue *_background_wq;
+
+/* struct work allocations, they should stop once freelists fill up */
+static unsigned long _work_allocs;
+
+/* Guards workers' current entries, timeout heaps and _workqueues. */
 static pthread_mutex_t _status_lock;
+static struct workqueue *_workqueues;
+/* armed for the earliest timeout check of all workqueues */
 static struct nakd_timer *_timeout_timer;
 
-static void __cancel_work(struct nakd_thread *thread) {
-    nakd_assert(pthread_kill(thread->tid, WQ_CANCEL_SIGNAL) >= 0);
+/* the entry being processed by the calling thread */
+static pthread_key_t _current_work;
+
+/* Accumulated per entry name, since startup or the last reset. */
+struct work_stats {
+    char *name;
+    unsigned long count;
+    unsigned long canceled;
+    /* us, from being queued till a worker picks it up */
+    uint64_t wait_total;
+    uint64_t wait_max;
+    unsigned long wait_histogram[WQ_STATS_HISTOGRAM];
+    /* us, in impl() */
+    uint64_t run_total;
+    uint64_t run_max;
+    unsigned long run_histogram[WQ_STATS_HISTOGRAM];
+
+    struct work_stats *next;
+};
+
+static struct work_stats *_stats[WQ_STATS_BUCKETS];
+static pthread_mutex_t _stats_lock;
+
+static uint64_t _monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec) * 1000 + now.tv_nsec / (int)(1e6);
 }
 
-static void __check_timeout(void) {
-    int now = time(NULL);
+static uint64_t _monotonic_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
 
-    /* TODO */
-    struct workqueue *wq = nakd_wq;
+static void _workqueue_loop(struct nakd_thread *thr);
+static void _workqueue_shutdown_cb(struct nakd_thread *thr);
 
-    pthread_mutex_lock(&_status_lock);
-    for (struct nakd_thread **thr = wq->threads;
-            thr < wq->threads + wq->threadcount;
-                                        thr++) {
-        struct worker_thread_priv *priv = (*thr)->priv;
-        if (priv->current != NULL && priv->current->desc.timeout) {
-            int processing_time = now - priv->current->start_time;
-
-            if (processing_time > priv->current->desc.timeout / 2) {
-                nakd_log(L_WARNING, "workqueue: \"%s\" is taking too much"
-                      " time: %ds", priv->current->desc.name, processing_time);
-                if (processing_time > priv->current->desc.timeout) {
-                    nakd_log(L_WARNING, "workqueue: canceling \"%s\".",
-                                                  priv->current->desc.name);
-                    __cancel_work(*thr);
-                }
-            }
-        }
+/* Starts a worker in the given slot of wq->threads, returns 0 on success. */
+static int __spawn_worker(struct workqueue *wq, struct nakd_thread **slot) {
+    struct worker_thread_priv *priv = calloc(1,
+                sizeof(struct worker_thread_priv));
+    nakd_assert(priv != NULL);
+    priv->wq = wq;
+
+    if (nakd_thread_create_joinable(_workqueue_loop, _workqueue_shutdown_cb,
+                                                              priv, slot)) {
+        free(priv);
+        return 1;
     }
-    pthread_mutex_unlock(&_status_lock);
+    return 0;
 }
 
-static void _timeout_sighandler(siginfo_t *timer_info,
-                           struct nakd_timer *timer) {
-    __check_timeout();
+static int __queued_count(struct workqueue *wq) {
+    int count = 0;
+    for (enum work_priority priority = 0; priority < WORK_PRIORITIES;
+                                                         priority++) {
+        count += wq->depth[priority];
+    }
+    return count;
+}
+
+static void __add_worker(struct workqueue *wq) {
+    if (wq->shutdown || wq->threadcount >= wq->max_threads)
+        return;
+
+    if (__spawn_worker(wq, &wq->threads[wq->threadcount])) {
+        nakd_log(L_WARNING, "workqueue: couldn't add a worker, %d running.",
+                                                          wq->threadcount);
+        return;
+    }
+    wq->threadcount++;
+    nakd_log(L_DEBUG, "workqueue: added a worker, %d running.",
+                                                  wq->threadcount);
+}
+
+/* Adds a worker if there are more queued entries than idle workers. */
+static void __grow(struct workqueue *wq) {
+    if (__queued_count(wq) > wq->idle)
+        __add_worker(wq);
+}
+
+/*
+ * Scheduled entries are only queued by idle workers, waiting for the next
+ * deadline - adds one if they're all busy.
+ */
+static void __watch_scheduled(struct workqueue *wq) {
+    if (!wq->scheduled.count)
+        return;
+
+    if (wq->idle)
+        pthread_cond_signal(&wq->cv);
+    else
+        __add_worker(wq);
+}
+
+/* Takes the calling worker out of wq->threads, it exits afterwards. */
+static void __retire_worker(struct workqueue *wq, struct nakd_thread *thr) {
+    struct nakd_thread **slot = wq->threads;
+    for (; slot < wq->threads + wq->threadcount && *slot != thr; slot++);
+    nakd_assert(slot < wq->threads + wq->threadcount);
+
+    *slot = wq->threads[--wq->threadcount];
+    /* nobody's going to join it */
+    nakd_thread_abandon(thr);
+    nakd_log(L_DEBUG, "workqueue: retiring an idle worker, %d left.",
+                                                     wq->threadcount);
+}
+
+static void __kick_work(struct work *work) {
+    nakd_assert(!pthread_kill(work->thread->tid, WQ_CANCEL_SIGNAL));
+}
+
+static void __cancel_work(struct work *work) {
+    __atomic_store_n(&work->canceled, 1, __ATOMIC_RELEASE);
+    __kick_work(work);
+}
+
+/*
+ * Cancellation token of the entry the calling thread processes, 0 if it's
+ * not a worker. Long-running entries are expected to check it and return
+ * early - blocking calls are interrupted with EINTR once it's set.
+ */
+int nakd_work_canceled(void) {
+    struct work *work = pthread_getspecific(_current_work);
+    if (work == NULL)
+        return 0;
+    return __atomic_load_n(&work->canceled, __ATOMIC_ACQUIRE);
+}
+
+static void _init_work(struct work *work, const struct work_desc *desc) {
+    work->desc = *desc;
+    work->status = WORK_QUEUED;
+    work->deadline = 0;
+    work->heap_idx = -1;
+    work->timeout_stage = WORK_TIMEOUT_WARN;
+    work->canceled = 0;
+    work->thread = NULL;
+    work->next = NULL;
 }
 
 struct work *nakd_alloc_work(const struct work_desc *desc) {
     struct work *work = calloc(1, sizeof(struct work));
     nakd_assert(work != NULL);
+    __atomic_add_fetch(&_work_allocs, 1, __ATOMIC_RELAXED);
 
     pthread_cond_init(&work->completed_cv, NULL);
-    work->desc = *desc;
+    _init_work(work, desc);
     return work;
 }
 
+unsigned long nakd_work_allocs(void) {
+    return __atomic_load_n(&_work_allocs, __ATOMIC_RELAXED);
+}
+
+static struct work_pending **__pending_bucket(struct workqueue *wq,
+                                               const char *name) {
+    /* djb2 */
+    unsigned int hash = 5381;
+    for (const char *c = name; *c; c++)
+        hash = hash * 33 + *c;
+    return &wq->pending[hash % NAKD_WQ_PENDING_BUCKETS];
+}
+
+static struct work_pending **__pending_find(struct workqueue *wq,
+                                             const char *name) {
+    struct work_pending **pending = __pending_bucket(wq, name);
+    for (; *pending != NULL; pending = &(*pending)->next) {
+        if (!strcmp(name, (*pending)->name))
+            break;
+    }
+    return pending;
+}
+
+static void __pending_inc(struct workqueue *wq, const char *name) {
+    if (name == NULL)
+        return;
+
+    struct work_pending **pending = __pending_find(wq, name);
+    if (*pending == NULL) {
+        *pending = calloc(1, sizeof(struct work_pending));
+        nakd_assert(*pending != NULL);
+        nakd_assert(((*pending)->name = strdup(name)) != NULL);
+    }
+    (*pending)->count++;
+    (*pending)->queued++;
+}
+
+static void __pending_dequeued(struct workqueue *wq, const char *name) {
+    if (name == NULL)
+        return;
+
+    struct work_pending *pending = *__pending_find(wq, name);
+    nakd_assert(pending != NULL);
+    pending->queued--;
+}
+
+static void __free_pending(struct workqueue *wq) {
+    for (struct work_pending **bucket = wq->pending;
+               bucket < ARRAY_END(wq->pending); bucket++) {
+        while (*bucket != NULL) {
+            struct work_pending *next = (*bucket)->next;
+            if ((*bucket)->rerun != NULL)
+                nakd_free_work((*bucket)->rerun);
+            free((*bucket)->name);
+            free(*bucket);
+            *bucket = next;
+        }
+    }
+}
+
 static struct work *__add_work(struct workqueue *wq, struct work *new) {
-    struct work **work = &wq->work;
-    while (*work != NULL)
-        work = &(*work)->next;
+    enum work_priority priority = new->desc.priority;
+    new->next = NULL;
+    *wq->tail[priority] = new;
+    wq->tail[priority] = &new->next;
+    wq->depth[priority]++;
+    __pending_inc(wq, new->desc.name);
+    new->queued_us = _monotonic_us();
+    return new;
+}
+
+/* Called once an entry with this name is done processing. */
+static void __pending_dec(struct workqueue *wq, const char *name) {
+    if (name == NULL)
+        return;
 
-    *work = new;
-    return *work;
+    struct work_pending **pending = __pending_find(wq, name);
+    nakd_assert(*pending != NULL);
+    (*pending)->count--;
+
+    struct work *rerun = (*pending)->rerun;
+    if (rerun != NULL && (*pending)->count == (*pending)->queued) {
+        /* none is being processed anymore, __add_work() counts it again */
+        (*pending)->rerun = NULL;
+        (*pending)->count--, (*pending)->queued--;
+        __add_work(wq, rerun);
+        pthread_cond_signal(&wq->cv);
+        return;
+    }
+
+    if ((*pending)->count)
+        return;
+
+    struct work_pending *unused = *pending;
+    *pending = unused->next;
+    free(unused->name);
+    free(unused);
+}
+
+static int __work_queued(struct workqueue *wq) {
+    for (enum work_priority priority = 0; priority < WORK_PRIORITIES;
+                                                         priority++) {
+        if (wq->work[priority] != NULL)
+            return 1;
+    }
+    return 0;
 }
 
 static struct work *__dequeue(struct workqueue *wq) {
-    if (wq->work == NULL)
-        return NULL;
+    for (const enum work_priority *priority = _dequeue_order;
+           priority < ARRAY_END(_dequeue_order); priority++) {
+        struct work *cur = wq->work[*priority];
+        if (cur == NULL)
+            continue;
 
-    struct work *cur = wq->work;
-    struct work *next = cur->next;
-    wq->work = next;
-    return cur;
+        wq->work[*priority] = cur->next;
+        if (cur->next == NULL)
+            wq->tail[*priority] = &wq->work[*priority];
+        wq->depth[*priority]--;
+        __pending_dequeued(wq, cur->desc.name);
+        return cur;
+    }
+    return NULL;
 }
 
 void nakd_free_work(struct work *work) {
@@ -97,24 +344,341 @@ void nakd_free_work(struct work *work) {
     free(work);
 }
 
-static void __free_queue(struct workqueue *wq) {
-    struct work *work = wq->work;
-    while (work != NULL) {
-        struct work *next = work->next;
+/* Takes an entry off the freelist, its condition variable is initialized. */
+static struct work *__get_work(struct workqueue *wq,
+                       const struct work_desc *desc) {
+    struct work *work = wq->free;
+    if (work == NULL)
+        return nakd_alloc_work(desc);
+
+    wq->free = work->next;
+    wq->free_count--;
+    _init_work(work, desc);
+    return work;
+}
+
+static void __recycle_work(struct workqueue *wq, struct work *work) {
+    if (wq->free_count >= WQ_FREELIST_MAX) {
         nakd_free_work(work);
-        work = next;
+        return;
+    }
+
+    work->next = wq->free;
+    wq->free = work;
+    wq->free_count++;
+}
+
+static void __free_freelist(struct workqueue *wq) {
+    while (wq->free != NULL) {
+        struct work *next = wq->free->next;
+        nakd_free_work(wq->free);
+        wq->free = next;
+    }
+    wq->free_count = 0;
+}
+
+static void __heap_swap(struct work_heap *heap, int a, int b) {
+    struct work *tmp = heap->works[a];
+    heap->works[a] = heap->works[b];
+    heap->works[b] = tmp;
+    heap->works[a]->heap_idx = a;
+    heap->works[b]->heap_idx = b;
+}
+
+static void __heap_up(struct work_heap *heap, int idx) {
+    while (idx) {
+        int parent = (idx - 1) / 2;
+        if (heap->works[parent]->deadline <= heap->works[idx]->deadline)
+            break;
+        __heap_swap(heap, parent, idx);
+        idx = parent;
+    }
+}
+
+static void __heap_down(struct work_heap *heap, int idx) {
+    for (;;) {
+        int min = idx;
+        int left = 2 * idx + 1, right = 2 * idx + 2;
+        if (left < heap->count &&
+              heap->works[left]->deadline < heap->works[min]->deadline)
+            min = left;
+        if (right < heap->count &&
+              heap->works[right]->deadline < heap->works[min]->deadline)
+            min = right;
+        if (min == idx)
+            break;
+        __heap_swap(heap, min, idx);
+        idx = min;
     }
 }
 
+static void __heap_push(struct work_heap *heap, struct work *work) {
+    if (heap->count == heap->size) {
+        heap->size = heap->size ? heap->size * 2 : 8;
+        heap->works = realloc(heap->works,
+                heap->size * sizeof(struct work *));
+        nakd_assert(heap->works != NULL);
+    }
+
+    work->heap_idx = heap->count;
+    heap->works[heap->count] = work;
+    __heap_up(heap, heap->count++);
+}
+
+static struct work *__heap_remove(struct work_heap *heap, int idx) {
+    struct work *work = heap->works[idx];
+    heap->works[idx] = heap->works[--heap->count];
+    heap->works[idx]->heap_idx = idx;
+    if (idx < heap->count) {
+        __heap_down(heap, idx);
+        __heap_up(heap, idx);
+    }
+    work->heap_idx = -1;
+    return work;
+}
+
+/* Call after changing the deadline of an entry in the heap. */
+static void __heap_update(struct work_heap *heap, int idx) {
+    __heap_down(heap, idx);
+    __heap_up(heap, idx);
+}
+
+static void __heap_free(struct work_heap *heap) {
+    free(heap->works), heap->works = NULL;
+    heap->count = heap->size = 0;
+}
+
+static void __arm_timeout_timer(void) {
+    uint64_t next = 0;
+    for (struct workqueue *wq = _workqueues; wq != NULL; wq = wq->next) {
+        if (!wq->timeouts.count)
+            continue;
+
+        uint64_t deadline = wq->timeouts.works[0]->deadline;
+        if (!next || deadline < next)
+            next = deadline;
+    }
+
+    if (!next) {
+        nakd_timer_mod(_timeout_timer, -1);
+        return;
+    }
+
+    uint64_t now = _monotonic_ms();
+    nakd_timer_mod(_timeout_timer, next > now ? next - now : 0);
+}
+
+/*
+ * Entries are warned about once half of the timeout passes, and canceled at
+ * the timeout. If they don't return within WQ_ABANDON_GRACE, their worker is
+ * abandoned.
+ */
+static void __watch_timeout(struct workqueue *wq, struct work *work) {
+    if (!work->desc.timeout)
+        return;
+
+    work->deadline = _monotonic_ms() + work->desc.timeout * 500;
+    work->timeout_stage = WORK_TIMEOUT_WARN;
+    __heap_push(&wq->timeouts, work);
+    __arm_timeout_timer();
+}
+
+static void __unwatch_timeout(struct workqueue *wq, struct work *work) {
+    if (work->heap_idx == -1)
+        return;
+
+    __heap_remove(&wq->timeouts, work->heap_idx);
+    __arm_timeout_timer();
+}
+
+/*
+ * Leaves the entry to its worker and puts a new one in its place. Returns 0
+ * on success.
+ */
+static int __abandon_work(struct workqueue *wq, struct work *work) {
+    pthread_mutex_lock(&wq->lock);
+    struct nakd_thread **slot = wq->threads;
+    for (; slot < wq->threads + wq->threadcount && *slot != work->thread;
+                                                                slot++);
+    nakd_assert(slot < wq->threads + wq->threadcount);
+
+    if (__spawn_worker(wq, slot)) {
+        nakd_log(L_CRIT, "workqueue: couldn't replace the worker stuck in "
+                                              "\"%s\".", work->desc.name);
+        *slot = work->thread;
+        pthread_mutex_unlock(&wq->lock);
+        return 1;
+    }
+
+    struct worker_thread_priv *abandoned = work->thread->priv;
+    abandoned->abandoned = 1;
+    nakd_thread_abandon(work->thread);
+
+    /* it's not in the way of entries with the same name anymore */
+    __pending_dec(wq, work->desc.name);
+    pthread_mutex_unlock(&wq->lock);
+    return 0;
+}
+
+/* Workers of abandoned entries are put on the list, for canceled(). */
+static void __check_timeouts(struct workqueue *wq, uint64_t now,
+                       struct worker_thread_priv **abandoned) {
+    while (wq->timeouts.count && wq->timeouts.works[0]->deadline <= now) {
+        struct work *work = wq->timeouts.works[0];
+        int processing_time = now - work->start_ms;
+        uint64_t abandon_at = work->start_ms + work->desc.timeout * 1000
+                                                      + WQ_ABANDON_GRACE;
+
+        switch (work->timeout_stage) {
+        case WORK_TIMEOUT_WARN:
+            nakd_log(L_WARNING, "workqueue: \"%s\" is taking too much"
+                                  " time: %dms", work->desc.name,
+                                                   processing_time);
+            work->timeout_stage = WORK_TIMEOUT_CANCEL;
+            work->deadline = work->start_ms + work->desc.timeout * 1000;
+            break;
+        case WORK_TIMEOUT_CANCEL:
+            nakd_log(L_WARNING, "workqueue: canceling \"%s\" after %dms.",
+                                          work->desc.name, processing_time);
+            __cancel_work(work);
+            work->timeout_stage = WORK_TIMEOUT_ABANDON;
+            work->deadline = now + WQ_CANCEL_KICK_INTERVAL;
+            break;
+        case WORK_TIMEOUT_ABANDON:
+            /* synchronous entries are owned by whoever waits for them */
+            if (now >= abandon_at && !work->desc.synchronous &&
+                                     !__abandon_work(wq, work)) {
+                nakd_log(L_CRIT, "workqueue: \"%s\" doesn't return after "
+                    "being canceled, abandoning its worker.", work->desc.name);
+                __heap_remove(&wq->timeouts, 0);
+                if (work->desc.canceled != NULL) {
+                    struct worker_thread_priv *priv = work->thread->priv;
+                    priv->canceled_pending = 1;
+                    priv->next_abandoned = *abandoned;
+                    *abandoned = priv;
+                }
+                continue;
+            }
+
+            /* might have missed the signal, between blocking calls */
+            __kick_work(work);
+            work->deadline = now + WQ_CANCEL_KICK_INTERVAL;
+            if (work->deadline > abandon_at && now < abandon_at)
+                work->deadline = abandon_at;
+            break;
+        }
+        __heap_update(&wq->timeouts, 0);
+    }
+}
+
+static void _timeout_handler(struct nakd_timer *timer) {
+    struct worker_thread_priv *abandoned = NULL;
+
+    pthread_mutex_lock(&_status_lock);
+    uint64_t now = _monotonic_ms();
+    for (struct workqueue *wq = _workqueues; wq != NULL; wq = wq->next)
+        __check_timeouts(wq, now, &abandoned);
+    __arm_timeout_timer();
+    pthread_mutex_unlock(&_status_lock);
+
+    /* the entries stay around till canceled_pending is cleared */
+    for (struct worker_thread_priv *priv = abandoned; priv != NULL;) {
+        struct worker_thread_priv *next = priv->next_abandoned;
+        struct work *work = priv->current;
+        work->desc.canceled(work->desc.priv);
+
+        pthread_mutex_lock(&_status_lock);
+        priv->canceled_pending = 0;
+        int returned = priv->returned;
+        pthread_mutex_unlock(&_status_lock);
+
+        /* impl() returned meanwhile, the worker left the entry to us */
+        if (returned) {
+            nakd_free_work(work);
+            free(priv);
+        }
+        priv = next;
+    }
+}
+
+static void __free_queue(struct workqueue *wq) {
+    while (wq->scheduled.count)
+        nakd_free_work(__heap_remove(&wq->scheduled, 0));
+    __heap_free(&wq->scheduled);
+
+    for (enum work_priority priority = 0; priority < WORK_PRIORITIES;
+                                                         priority++) {
+        struct work *work = wq->work[priority];
+        while (work != NULL) {
+            struct work *next = work->next;
+            nakd_free_work(work);
+            work = next;
+        }
+    }
+}
+
+/*
+ * Returns 1 if the entry was coalesced with a pending one and freed, 2 if
+ * it's been put aside to be queued after the one being processed.
+ */
+static int __coalesce(struct workqueue *wq, struct work *work) {
+    if (work->desc.coalesce == WORK_NO_COALESCE || work->desc.synchronous ||
+                                                    work->desc.name == NULL) {
+        return 0;
+    }
+
+    struct work_pending *pending = *__pending_find(wq, work->desc.name);
+    if (pending == NULL)
+        return 0;
+
+    if (work->desc.coalesce == WORK_COALESCE_RERUN && !pending->queued) {
+        /* counted as queued, so that it's coalesced with further ones */
+        pending->rerun = work;
+        pending->count++, pending->queued++;
+        work->status = WORK_QUEUED;
+        return 2;
+    }
+
+    nakd_log(L_DEBUG, "workqueue: coalescing \"%s\"", work->desc.name);
+    __recycle_work(wq, work);
+    return 1;
+}
+
+/* Returns 1 if the entry was coalesced and freed, see __coalesce(). */
+static int __queue_work(struct workqueue *wq, struct work *work) {
+    int coalesced = __coalesce(wq, work);
+    if (coalesced)
+        return coalesced == 1;
+
+    struct work *new = __add_work(wq, work);
+    new->status = WORK_QUEUED;
+    pthread_cond_signal(&wq->cv);
+    __grow(wq);
+    return 0;
+}
+
+static void __schedule_work(struct workqueue *wq, struct work *work,
+                                                    int delay_ms) {
+    work->deadline = _monotonic_ms() + delay_ms;
+    work->status = WORK_SCHEDULED;
+    __heap_push(&wq->scheduled, work);
+    /* an idle worker has to wait for the new deadline */
+    __watch_scheduled(wq);
+}
+
+/* Moves scheduled entries that are due to the queues. */
+static void __queue_due(struct workqueue *wq) {
+    if (!wq->scheduled.count)
+        return;
+
+    uint64_t now = _monotonic_ms();
+    while (wq->scheduled.count && wq->scheduled.works[0]->deadline <= now)
+        __queue_work(wq, __heap_remove(&wq->scheduled, 0));
+}
+
 static void _cancel_sighandler(int signum) {
     nakd_assert(signum == WQ_CANCEL_SIGNAL);
-
-    struct nakd_thread *thread = nakd_thread_private();
-    struct worker_thread_priv *priv = thread->priv;
-    struct work *current = priv->current;
-    if (current->desc.canceled != NULL)
-        current->desc.canceled(current->desc.priv);
-    siglongjmp(current->canceled_jmpbuf, 1);
+    /* nothing to do - it's there to interrupt blocking calls */
 }
 
 static void _setup_cancel_sighandler(void) {
@@ -135,9 +699,101 @@ static void _unblock_cancel_signal(void) {
     nakd_assert(!pthread_sigmask(SIG_UNBLOCK, &cancel, NULL));
 }
 
+static int _histogram_bucket(uint64_t us) {
+    int bucket = 0;
+    while (bucket < WQ_STATS_HISTOGRAM - 1 && us >= (uint64_t)(1) << bucket)
+        bucket++;
+    return bucket;
+}
+
+static struct work_stats *__stats_get(const char *name) {
+    /* djb2 */
+    unsigned int hash = 5381;
+    for (const char *c = name; *c; c++)
+        hash = hash * 33 + *c;
+
+    struct work_stats **bucket = &_stats[hash % WQ_STATS_BUCKETS];
+    for (; *bucket != NULL; bucket = &(*bucket)->next) {
+        if (!strcmp((*bucket)->name, name))
+            return *bucket;
+    }
+
+    *bucket = calloc(1, sizeof(struct work_stats));
+    nakd_assert(*bucket != NULL);
+    (*bucket)->name = strdup(name);
+    nakd_assert((*bucket)->name != NULL);
+    return *bucket;
+}
+
+static void _stats_record(struct work *work, uint64_t wait_us,
+                                                uint64_t run_us) {
+    pthread_mutex_lock(&_stats_lock);
+    struct work_stats *stats = __stats_get(work->desc.name != NULL ?
+                                         work->desc.name : "(unnamed)");
+    stats->count++;
+    if (work->status == WORK_CANCELED)
+        stats->canceled++;
+
+    stats->wait_total += wait_us;
+    if (wait_us > stats->wait_max)
+        stats->wait_max = wait_us;
+    stats->wait_histogram[_histogram_bucket(wait_us)]++;
+
+    stats->run_total += run_us;
+    if (run_us > stats->run_max)
+        stats->run_max = run_us;
+    stats->run_histogram[_histogram_bucket(run_us)]++;
+    pthread_mutex_unlock(&_stats_lock);
+}
+
+static void __stats_reset(void) {
+    for (struct work_stats **bucket = _stats; bucket < ARRAY_END(_stats);
+                                                               bucket++) {
+        while (*bucket != NULL) {
+            struct work_stats *next = (*bucket)->next;
+            free((*bucket)->name);
+            free(*bucket);
+            *bucket = next;
+        }
+    }
+}
+
+/*
+ * Waits for an entry, until the next scheduled one is due or, if the worker
+ * could retire, until it's been idle for WQ_IDLE_TIMEOUT.
+ */
+static void __wait_for_work(struct workqueue *wq, uint64_t idle_since) {
+    uint64_t deadline = 0;
+    if (wq->scheduled.count)
+        deadline = wq->scheduled.works[0]->deadline;
+    if (wq->threadcount > wq->min_threads) {
+        uint64_t retire_at = idle_since + WQ_IDLE_TIMEOUT;
+        if (!deadline || retire_at < deadline)
+            deadline = retire_at;
+    }
+
+    wq->idle++;
+    if (deadline) {
+        struct timespec ts = {
+            .tv_sec = deadline / 1000,
+            .tv_nsec = deadline % 1000 * (int)(1e6)
+        };
+        pthread_cond_timedwait(&wq->cv, &wq->lock, &ts);
+    } else {
+        pthread_cond_wait(&wq->cv, &wq->lock);
+    }
+    wq->idle--;
+}
+
+static int __worker_expired(struct workqueue *wq, uint64_t idle_since) {
+    return wq->threadcount > wq->min_threads &&
+       _monotonic_ms() >= idle_since + WQ_IDLE_TIMEOUT;
+}
+
 static void _workqueue_loop(struct nakd_thread *thr) {
     struct worker_thread_priv *priv = thr->priv;
     struct workqueue *wq = priv->wq;
+    uint64_t idle_since = _monotonic_ms();
 
     _unblock_cancel_signal();
 
@@ -146,13 +802,25 @@ static void _workqueue_loop(struct nakd_thread *thr) {
         if (wq->shutdown)
             break;
 
-        if (wq->work == NULL) {
-            pthread_cond_wait(&wq->cv, &wq->lock);
+        __queue_due(wq);
+        if (!__work_queued(wq)) {
+            if (__worker_expired(wq, idle_since)) {
+                __retire_worker(wq, thr);
+                pthread_mutex_unlock(&wq->lock);
+                free(priv);
+                return;
+            }
+
+            __wait_for_work(wq, idle_since);
             if (wq->shutdown)
                 break;
+            __queue_due(wq);
         }
 
         struct work *work = __dequeue(wq);
+        /* hand waiting for the next deadline over to another worker */
+        if (work != NULL)
+            __watch_scheduled(wq);
         pthread_mutex_unlock(&wq->lock);
 
         if (work == NULL)
@@ -163,15 +831,40 @@ static void _workqueue_loop(struct nakd_thread *thr) {
 
         pthread_mutex_lock(&_status_lock);
         work->start_time = time(NULL);
+        work->start_ms = _monotonic_ms();
+        work->thread = thr;
         priv->current = work;
+        __watch_timeout(wq, work);
         pthread_mutex_unlock(&_status_lock);
 
-        if (!sigsetjmp(work->canceled_jmpbuf, 1)) {
-            work->status = WORK_PROCESSING;
-            work->desc.impl(work->desc.priv);
-            work->status = WORK_DONE;
-        } else {
-            work->status = WORK_CANCELED;
+        pthread_setspecific(_current_work, work);
+        work->status = WORK_PROCESSING;
+        uint64_t start_us = _monotonic_us();
+        work->desc.impl(work->desc.priv);
+        work->status = nakd_work_canceled() ? WORK_CANCELED : WORK_DONE;
+        _stats_record(work, start_us - work->queued_us,
+                        _monotonic_us() - start_us);
+        pthread_setspecific(_current_work, NULL);
+
+        pthread_mutex_lock(&_status_lock);
+        __unwatch_timeout(wq, work);
+        int abandoned = priv->abandoned;
+        int canceled_pending = priv->canceled_pending;
+        if (abandoned)
+            priv->returned = 1;
+        else
+            priv->current = NULL;
+        pthread_mutex_unlock(&_status_lock);
+
+        if (abandoned) {
+            nakd_log(L_NOTICE, "workqueue: abandoned \"%s\" returned after "
+                 "%ds.", work->desc.name, time(NULL) - work->start_time);
+            /* the workqueue's got another worker in place of this one */
+            if (!canceled_pending) {
+                nakd_free_work(work);
+                free(priv);
+            }
+            return;
         }
 
         time_t now = time(NULL);
@@ -179,47 +872,84 @@ static void _workqueue_loop(struct nakd_thread *thr) {
             nakd_log(L_DEBUG, "workqueue: finished \"%s\", took %ds",
                                  work->desc.name, now - work->start_time);
 
-        pthread_cond_broadcast(&work->completed_cv);
-
-        pthread_mutex_lock(&_status_lock);
-        priv->current = NULL;
-        pthread_mutex_unlock(&_status_lock);
-        if (!work->desc.synchronous)
-            nakd_free_work(work);
+        pthread_mutex_lock(&wq->lock);
+        __pending_dec(wq, work->desc.name);
+        /* synchronous entries are freed by whoever added them */
+        if (work->desc.synchronous)
+            pthread_cond_broadcast(&work->completed_cv);
+        else
+            __recycle_work(wq, work);
+        pthread_mutex_unlock(&wq->lock);
+        idle_since = _monotonic_ms();
     }
     pthread_mutex_unlock(&wq->lock);
 }
 
 static void _workqueue_shutdown_cb(struct nakd_thread *thr) {
-    struct workqueue *wq = thr->priv;
-    wq->shutdown = 1;
+    struct worker_thread_priv *priv = thr->priv;
+    priv->wq->shutdown = 1;
 }
 
-void nakd_workqueue_create(struct workqueue **wq, int threadcount) {
+/*
+ * Starts with min_threads workers, more are added while entries queue up,
+ * up to max_threads. The ones above min_threads exit once idle for a while.
+ */
+void nakd_workqueue_create(struct workqueue **wq, int min_threads,
+                                                  int max_threads) {
+    nakd_assert(min_threads > 0 && max_threads >= min_threads);
     *wq = calloc(1, sizeof(struct workqueue));
 
     pthread_mutex_init(&(*wq)->lock, NULL);
-    pthread_cond_init(&(*wq)->cv, NULL);
-
-    (*wq)->threadcount = threadcount;
-    (*wq)->threads = calloc(threadcount, sizeof(struct nakd_thread *));
+    /* scheduled entries' deadlines are monotonic */
+    pthread_condattr_t cv_attr;
+    pthread_condattr_init(&cv_attr);
+    pthread_condattr_setclock(&cv_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(*wq)->cv, &cv_attr);
+    pthread_condattr_destroy(&cv_attr);
+    for (enum work_priority priority = 0; priority < WORK_PRIORITIES;
+                                                         priority++) {
+        (*wq)->tail[priority] = &(*wq)->work[priority];
+    }
 
-    for (struct nakd_thread **thr = (*wq)->threads;
-                thr < (*wq)->threads + threadcount;
-                                           thr++) {
-        /* TODO implement custom cleanup in thread.c */
-        struct worker_thread_priv *priv = calloc(1,
-                sizeof(struct worker_thread_priv));
-        nakd_assert(priv != NULL);
-        priv->wq = *wq;
-        priv->current = NULL;
+    (*wq)->min_threads = min_threads;
+    (*wq)->max_threads = max_threads;
+    (*wq)->threads = calloc(max_threads, sizeof(struct nakd_thread *));
+    nakd_assert((*wq)->threads != NULL);
 
-        nakd_assert(!nakd_thread_create_joinable(_workqueue_loop,
-                             _workqueue_shutdown_cb, priv, thr));
+    /* workers wait for the lock, until everything's in place */
+    pthread_mutex_lock(&(*wq)->lock);
+    for (; (*wq)->threadcount < min_threads; (*wq)->threadcount++) {
+        nakd_assert(!__spawn_worker(*wq,
+            &(*wq)->threads[(*wq)->threadcount]));
     }
+    pthread_mutex_unlock(&(*wq)->lock);
+
+    pthread_mutex_lock(&_status_lock);
+    (*wq)->next = _workqueues;
+    _workqueues = *wq;
+    pthread_mutex_unlock(&_status_lock);
 }
 
 void nakd_workqueue_destroy(struct workqueue **wq) {
+    pthread_mutex_lock(&_status_lock);
+    for (struct workqueue **iter = &_workqueues; *iter != NULL;
+                                         iter = &(*iter)->next) {
+        if (*iter == *wq) {
+            *iter = (*wq)->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_status_lock);
+
+    /*
+     * Wake up idle workers, signals won't interrupt pthread_cond_wait().
+     * Workers don't come and go after that.
+     */
+    pthread_mutex_lock(&(*wq)->lock);
+    (*wq)->shutdown = 1;
+    pthread_cond_broadcast(&(*wq)->cv);
+    pthread_mutex_unlock(&(*wq)->lock);
+
     for (struct nakd_thread **thr = (*wq)->threads;
          thr < (*wq)->threads + (*wq)->threadcount;
                                            thr++) {
@@ -228,83 +958,297 @@ void nakd_workqueue_destroy(struct workqueue **wq) {
     free((*wq)->threads);
 
     __free_queue(*wq); 
+    __free_pending(*wq);
+    __free_freelist(*wq);
+    __heap_free(&(*wq)->timeouts);
 
     pthread_mutex_destroy(&(*wq)->lock);
     pthread_cond_destroy(&(*wq)->cv);
     free(*wq), *wq = NULL;
 }
 
-void nakd_workqueue_add(struct workqueue *wq, struct work *work) {
+/*
+ * Entries of the given class added to wq are handled by pool instead. Meant
+ * to be called before anything is added.
+ */
+void nakd_workqueue_bind(struct workqueue *wq, enum work_priority priority,
+                                                   struct workqueue *pool) {
+    nakd_assert(priority >= 0 && priority < WORK_PRIORITIES);
+    wq->pools[priority] = pool == wq ? NULL : pool;
+}
+
+static struct workqueue *_pool(struct workqueue *wq,
+                       enum work_priority priority) {
+    return wq->pools[priority] != NULL ? wq->pools[priority] : wq;
+}
+
+int nakd_workqueue_add(struct workqueue *wq, struct work *work) {
+    nakd_assert(work->desc.priority >= 0 &&
+             work->desc.priority < WORK_PRIORITIES);
+    wq = _pool(wq, work->desc.priority);
+
     pthread_mutex_lock(&wq->lock);
-    struct work *new = __add_work(wq, work);
-    new->status = WORK_QUEUED;
-    pthread_cond_signal(&wq->cv);
-    if (!work->desc.synchronous) {
-        pthread_mutex_unlock(&wq->lock);
-    } else {
-        pthread_cond_wait(&work->completed_cv, &wq->lock);
+    if (__queue_work(wq, work)) {
         pthread_mutex_unlock(&wq->lock);
+        return 1;
     }
+
+    if (work->desc.synchronous)
+        pthread_cond_wait(&work->completed_cv, &wq->lock);
+    pthread_mutex_unlock(&wq->lock);
+    return 0;
 }
 
-int nakd_work_pending(struct workqueue *wq, const char *name) {
-    int s = 0;
+/*
+ * Queued once delay_ms passes, coalesced at that point if need be. Until
+ * then, it isn't pending and can be canceled with
+ * nakd_workqueue_cancel_delayed().
+ */
+void nakd_workqueue_add_delayed(struct workqueue *wq, struct work *work,
+                                                           int delay_ms) {
+    nakd_assert(work->desc.priority >= 0 &&
+             work->desc.priority < WORK_PRIORITIES);
+    nakd_assert(!work->desc.synchronous);
+    wq = _pool(wq, work->desc.priority);
+
+    pthread_mutex_lock(&wq->lock);
+    __schedule_work(wq, work, delay_ms);
+    pthread_mutex_unlock(&wq->lock);
+}
+
+/*
+ * Like nakd_workqueue_add(), but the entry is taken from the workqueue's
+ * freelist - desc can live on the stack. Not for synchronous entries.
+ */
+int nakd_workqueue_submit(struct workqueue *wq, const struct work_desc *desc) {
+    nakd_assert(desc->priority >= 0 && desc->priority < WORK_PRIORITIES);
+    nakd_assert(!desc->synchronous);
+    wq = _pool(wq, desc->priority);
+
     pthread_mutex_lock(&wq->lock);
+    int coalesced = __queue_work(wq, __get_work(wq, desc));
+    pthread_mutex_unlock(&wq->lock);
+    return coalesced;
+}
 
-    /* check queue */
-    struct work *work = wq->work;
-    while (work != NULL) {
-        if (!strcmp(name, work->desc.name)) {
-            s = 1;
-            goto unlock_wq;
-        }
-        work = work->next;
-    }
+void nakd_workqueue_submit_delayed(struct workqueue *wq,
+               const struct work_desc *desc, int delay_ms) {
+    nakd_assert(desc->priority >= 0 && desc->priority < WORK_PRIORITIES);
+    nakd_assert(!desc->synchronous);
+    wq = _pool(wq, desc->priority);
 
-    /* check already dequeued */
-    pthread_mutex_lock(&_status_lock);
-    for (struct nakd_thread **thr = wq->threads;
-            thr < wq->threads + wq->threadcount;
-                                        thr++) {
-        struct worker_thread_priv *priv = (*thr)->priv;
-        if (priv->current == NULL)
-            continue;
+    pthread_mutex_lock(&wq->lock);
+    __schedule_work(wq, __get_work(wq, desc), delay_ms);
+    pthread_mutex_unlock(&wq->lock);
+}
 
-        if (!strcmp(name, priv->current->desc.name)) {
-            s = 1;
-            goto unlock_workers;
+static int _cancel_delayed(struct workqueue *wq, const char *name) {
+    int canceled = 0;
+
+    pthread_mutex_lock(&wq->lock);
+    for (int idx = 0; idx < wq->scheduled.count;) {
+        struct work *work = wq->scheduled.works[idx];
+        if (work->desc.name == NULL || strcmp(work->desc.name, name)) {
+            idx++;
+            continue;
         }
+
+        __recycle_work(wq, __heap_remove(&wq->scheduled, idx));
+        canceled++;
+        /* the heap's been reordered */
+        idx = 0;
+    }
+    pthread_mutex_unlock(&wq->lock);
+    return canceled;
+}
+
+/* Drops scheduled, not yet queued entries. Returns how many were dropped. */
+int nakd_workqueue_cancel_delayed(struct workqueue *wq, const char *name) {
+    int canceled = _cancel_delayed(wq, name);
+    for (enum work_priority priority = 0; priority < WORK_PRIORITIES;
+                                                         priority++) {
+        if (wq->pools[priority] != NULL)
+            canceled += _cancel_delayed(wq->pools[priority], name);
     }
+    return canceled;
+}
 
-unlock_workers:
-    pthread_mutex_unlock(&_status_lock);
-unlock_wq:
+static int _work_pending(struct workqueue *wq, const char *name) {
+    pthread_mutex_lock(&wq->lock);
+    int s = *__pending_find(wq, name) != NULL;
     pthread_mutex_unlock(&wq->lock);
     return s;
 }
 
+/*
+ * Whether an entry with this name is either queued or being processed, by
+ * wq or any of the pools bound to it.
+ */
+int nakd_work_pending(struct workqueue *wq, const char *name) {
+    if (_work_pending(wq, name))
+        return 1;
+
+    for (enum work_priority priority = 0; priority < WORK_PRIORITIES;
+                                                         priority++) {
+        if (wq->pools[priority] != NULL &&
+               _work_pending(wq->pools[priority], name)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Reads a thread count from nakd configuration. */
+static int _config_threads(const char *key, int def) {
+    char *val = NULL;
+    if (nakd_config_key(key, &val))
+        return def;
+
+    char *end;
+    long threads = strtol(val, &end, 10);
+    if (*val == 0 || *end != 0 || threads < 1 ||
+               threads > NAKD_WQ_MAX_THREADS) {
+        nakd_log(L_WARNING, "workqueue: invalid %s: \"%s\", using %d.", key,
+                                                                val, def);
+        threads = def;
+    }
+    free(val);
+    return threads;
+}
+
+static void _create_configured(struct workqueue **wq, const char *min_key,
+                      const char *max_key, int def_min, int def_max) {
+    int min_threads = _config_threads(min_key, def_min);
+    int max_threads = _config_threads(max_key, def_max);
+    if (max_threads < min_threads) {
+        nakd_log(L_WARNING, "workqueue: %s is less than %s, using %d.",
+                                         max_key, min_key, min_threads);
+        max_threads = min_threads;
+    }
+    nakd_workqueue_create(wq, min_threads, max_threads);
+}
+
 static int _workqueue_init(void) {
     pthread_mutex_init(&_status_lock, NULL);
+    pthread_mutex_init(&_stats_lock, NULL);
+    pthread_key_create(&_current_work, NULL);
     /* cancel wq entries on timeout */
     _setup_cancel_sighandler();
-    nakd_workqueue_create(&nakd_wq, NAKD_DEFAULT_WQ_THREADS);
-    _timeout_timer = nakd_timer_add(TIMEOUT_CHECK_INTERVAL,
-                                _timeout_sighandler, NULL);
+    _timeout_timer = nakd_timer_add_oneshot(-1, _timeout_handler, NULL);
+    _create_configured(&nakd_wq, "wq_min_threads", "wq_max_threads",
+                                      NAKD_DEFAULT_WQ_MIN_THREADS,
+                                      NAKD_DEFAULT_WQ_MAX_THREADS);
+    /* so that scans and scripts don't hold up everything else */
+    _create_configured(&_background_wq, "background_wq_min_threads",
+                                        "background_wq_max_threads",
+                                      NAKD_BACKGROUND_WQ_MIN_THREADS,
+                                      NAKD_BACKGROUND_WQ_MAX_THREADS);
+    nakd_workqueue_bind(nakd_wq, WORK_PRIORITY_BACKGROUND, _background_wq);
     return 0;
 }
 
 static int _workqueue_cleanup(void) {
-    nakd_timer_remove(_timeout_timer);
     nakd_workqueue_destroy(&nakd_wq);
+    nakd_workqueue_destroy(&_background_wq);
+    /* workers rearm it, so not before they're gone */
+    nakd_timer_remove(_timeout_timer);
+    pthread_key_delete(_current_work);
     pthread_mutex_destroy(&_status_lock);
+
+    pthread_mutex_lock(&_stats_lock);
+    __stats_reset();
+    pthread_mutex_unlock(&_stats_lock);
+    pthread_mutex_destroy(&_stats_lock);
     return 0;
 }
 
 static struct nakd_module module_workqueue = {
     .name = "workqueue",
-    .deps = (const char *[]){ "thread", "timer", NULL },
+    .deps = (const char *[]){ "thread", "timer", "config", NULL },
     .init = _workqueue_init,
     .cleanup = _workqueue_cleanup
 };
 
 NAKD_DECLARE_MODULE(module_workqueue);
+
+/* Nonempty buckets, keyed with their upper bound in us. */
+static json_object *_histogram_json(const unsigned long *histogram) {
+    json_object *jhistogram = json_object_new_object();
+    for (int bucket = 0; bucket < WQ_STATS_HISTOGRAM; bucket++) {
+        if (!histogram[bucket])
+            continue;
+
+        char bound[24];
+        if (bucket == WQ_STATS_HISTOGRAM - 1)
+            snprintf(bound, sizeof bound, "inf");
+        else
+            snprintf(bound, sizeof bound, "%llu",
+                     (unsigned long long)(1) << bucket);
+        json_object_object_add(jhistogram, bound,
+                     json_object_new_int64(histogram[bucket]));
+    }
+    return jhistogram;
+}
+
+static json_object *_stats_json(struct work_stats *stats) {
+    json_object *jstats = json_object_new_object();
+    json_object_object_add(jstats, "count",
+                  json_object_new_int64(stats->count));
+    json_object_object_add(jstats, "canceled",
+               json_object_new_int64(stats->canceled));
+    json_object_object_add(jstats, "wait_total_us",
+             json_object_new_int64(stats->wait_total));
+    json_object_object_add(jstats, "wait_max_us",
+               json_object_new_int64(stats->wait_max));
+    json_object_object_add(jstats, "wait_histogram",
+            _histogram_json(stats->wait_histogram));
+    json_object_object_add(jstats, "run_total_us",
+              json_object_new_int64(stats->run_total));
+    json_object_object_add(jstats, "run_max_us",
+                json_object_new_int64(stats->run_max));
+    json_object_object_add(jstats, "run_histogram",
+             _histogram_json(stats->run_histogram));
+    return jstats;
+}
+
+json_object *cmd_workqueue_stats(json_object *jcmd, void *arg) {
+    json_object *jparams = nakd_jsonrpc_params(jcmd);
+    json_object *jreset = NULL;
+    /* anything else in params is ignored, eg. {} or [] */
+    if (jparams != NULL && json_object_get_type(jparams) == json_type_object)
+        json_object_object_get_ex(jparams, "reset", &jreset);
+    if (jreset != NULL && json_object_get_type(jreset) != json_type_boolean) {
+        return nakd_jsonrpc_response_error(jcmd, INVALID_PARAMS,
+                   "Invalid parameters - \"reset\" should be a boolean");
+    }
+
+    json_object *jresult = json_object_new_object();
+    pthread_mutex_lock(&_stats_lock);
+    for (struct work_stats **bucket = _stats; bucket < ARRAY_END(_stats);
+                                                               bucket++) {
+        for (struct work_stats *stats = *bucket; stats != NULL;
+                                           stats = stats->next) {
+            json_object_object_add(jresult, stats->name,
+                                      _stats_json(stats));
+        }
+    }
+    if (jreset != NULL && json_object_get_boolean(jreset))
+        __stats_reset();
+    pthread_mutex_unlock(&_stats_lock);
+
+    return nakd_jsonrpc_response_success(jcmd, jresult);
+}
+
+static struct nakd_command workqueue_stats = {
+    .name = "workqueue_stats",
+    .desc = "Per workqueue entry name: count, cancellations, time spent "
+         "queued and in impl() - total, max and histograms keyed with "
+        "their buckets' upper bound, all in microseconds. With \"reset\" "
+                                  "set, the statistics are cleared too.",
+    .usage = "{\"jsonrpc\": \"2.0\", \"method\": \"workqueue_stats\", "
+                         "\"params\": {\"reset\": true}, \"id\": 42}",
+    .handler = cmd_workqueue_stats,
+    .access = ACCESS_ROOT,
+    .module = &module_workqueue
+};
+NAKD_DECLARE_COMMAND(workqueue_stats);